@@ -0,0 +1,90 @@
+#include "aot.h"
+#include "chip8.h"
+
+#include <algorithm>
+#include <cstring>
+
+AotRuntime::AotRuntime(const AotProgram& program)
+    : m_Index(0x1000)
+{
+    for (int i = 0; i < program.blockCount; i++)
+    {
+        const AotBlock& block = program.blocks[i];
+        m_Index[block.start & 0x0FFF].block = &block;
+        m_Index[block.start & 0x0FFF].offset = 0;
+    }
+
+    // addresses inside a block resume it partway unless a block starts there
+    for (int i = 0; i < program.blockCount; i++)
+    {
+        const AotBlock& block = program.blocks[i];
+        for (int j = 1; j < block.length; j++)
+        {
+            Entry& entry = m_Index[(block.start + j * 2) & 0x0FFF];
+            if (0 == entry.block)
+            {
+                entry.block = &block;
+                entry.offset = j;
+            }
+        }
+    }
+}
+
+// Runs in the same timer slices as Chip8::ExecuteOpcodes
+void AotRuntime::Execute(Chip8& cpu, int count)
+{
+    while (count > 0)
+    {
+        int slice = cpu.BeginSlice(count);
+        count -= slice;
+        Run(cpu, slice);
+    }
+}
+
+void AotRuntime::Run(Chip8& cpu, int count)
+{
+    while (count > 0)
+    {
+        // addresses wrap at 4K
+        WORD pc = cpu.m_ProgramCounter &= 0x0FFF;
+        const Entry& entry = m_Index[pc];
+        const AotBlock* block = entry.block;
+
+        // a slice may end inside the block, the next one resumes there
+        int first = entry.offset;
+        int last = block ? std::min(block->length, first + count) : 0;
+
+        // fall back to the interpreter for unknown or self-modified code
+        if (0 == block || pc + (last - first) * 2 > 0x1000 ||
+            0 != memcmp(&cpu.m_GameMemory[pc], block->code + first * 2, (last - first) * 2))
+        {
+            cpu.InterpretOpcodes(1);
+            count--;
+            continue;
+        }
+
+        block->function(cpu, first, last);
+        count -= last - first;
+    }
+}
+
+BYTE* AotRuntime::Registers(Chip8& cpu)
+{
+    return cpu.m_Registers;
+}
+
+WORD& AotRuntime::AddressI(Chip8& cpu)
+{
+    return cpu.m_AddressI;
+}
+
+WORD& AotRuntime::ProgramCounter(Chip8& cpu)
+{
+    return cpu.m_ProgramCounter;
+}
+
+// Runs one instruction through the interpreter's handler
+void AotRuntime::ExecuteOpcode(Chip8& cpu, WORD opcode)
+{
+    cpu.ExecuteInstruction(Chip8::s_DecodeTable[opcode]);
+}
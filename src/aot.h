@@ -0,0 +1,55 @@
+#pragma once
+#include "instruction.h"
+
+#include <vector>
+
+class Chip8;
+
+// A block of a ROM translated ahead of time by chip8-recompile
+struct AotBlock
+{
+    WORD start ;              // address of the first instruction
+    int length ;              // number of instructions
+    const BYTE* code ;        // the opcodes the block was translated from
+    void (*function)(Chip8& cpu, int first, int last) ; // runs instructions [first, last)
+};
+
+// Everything chip8-recompile emits for one ROM
+struct AotProgram
+{
+    const char* romName ;
+    const AotBlock* blocks ;
+    int blockCount ;
+};
+
+// Defined by the file chip8-recompile generates
+const AotProgram& GetAotProgram();
+
+// Runs a recompiled program against a Chip8. Blocks whose code was never
+// discovered, was changed at runtime or is reached by a computed jump are
+// run by the interpreter instead.
+class AotRuntime
+{
+public:
+    explicit AotRuntime(const AotProgram& program);
+
+    void Execute(Chip8& cpu, int count);
+
+    // helpers used by the generated code
+    static BYTE* Registers(Chip8& cpu);
+    static WORD& AddressI(Chip8& cpu);
+    static WORD& ProgramCounter(Chip8& cpu);
+    static void ExecuteOpcode(Chip8& cpu, WORD opcode);
+
+private:
+    void Run(Chip8& cpu, int count);
+
+    // the block covering an address and the instruction it starts at there
+    struct Entry
+    {
+        const AotBlock* block ;
+        int offset ;
+    };
+
+    std::vector<Entry> m_Index ;
+};
@@ -0,0 +1,272 @@
+#include "chip8.h"
+#include "pacer.h"
+#include "savestate.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Runs many independent Chip8 machines over a work-stealing thread pool,
+// one job per ROM/quirk/frame-count combination, and reports the final
+// display hash, instructions executed and wall time of each. A job whose
+// file is a savestate (.c8s) resumes from it instead of starting the ROM.
+//
+// usage: chip8-batch [-t threads] [-f frames] [-s opcodes-per-second] [-q quirks] [-r repeat] [-l jobfile] [-j] [-S] [rom...]
+
+static void PrintUsage(const char* exe)
+{
+    printf("usage: %s [-t threads] [-f frames] [-s opcodes-per-second] [-q quirks] [-r repeat] [-l jobfile] [-j] [-S] [rom...]\n", exe);
+    printf("  -t  worker threads (default: one per hardware thread)\n");
+    printf("  -f  number of 60Hz frames per job (default 600)\n");
+    printf("  -s  opcodes executed per second of emulated time (default 700)\n");
+    printf("  -q  quirk profile for roms given on the command line\n");
+    printf("  -r  queue every job this many times\n");
+    printf("  -l  read jobs from a file, one \"rom [frames [quirks]]\" per line\n");
+    printf("  a rom can also be a savestate (.c8s) to resume from\n");
+    printf("  -j  run every machine on the x86-64 JIT\n");
+    printf("  -S  rerun the batch on 1, 2, 4 ... threads and report the scaling\n");
+}
+
+struct BatchJob
+{
+    std::string rom ;
+    long long frames ;
+    QuirkProfile quirks ;
+};
+
+struct BatchResult
+{
+    bool loaded ;
+    QuirkProfile quirks ; // the job's, or the savestate's
+    uint64_t hash ;       // display hash after the last frame
+    long long cycles ;    // instructions executed
+    double seconds ;      // wall time of the job
+};
+
+struct BatchOptions
+{
+    int opcodesPerSecond ;
+    bool useJit ;
+};
+
+static BatchResult RunJob(const BatchJob& job, const BatchOptions& options)
+{
+    BatchResult result = { false, job.quirks, 0, 0, 0.0 };
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    Chip8 cpu;
+    bool loaded = IsSaveStateFile(job.rom) ? ReadSaveState(job.rom, cpu) : cpu.LoadRom(job.rom, job.quirks);
+    if (!loaded)
+        return result;
+    if (options.useJit)
+        cpu.EnableJit(true);
+    cpu.SetOpcodesPerSecond(options.opcodesPerSecond);
+
+    // frames run the same budgets as the emulator, a savestate resumes its schedule
+    long long first = cpu.GetInstructionCount();
+    for (long long frame = 0; frame < job.frames; frame++)
+        cpu.ExecuteOpcodes(FramePacer::GetBudget(cpu.GetInstructionCount(), options.opcodesPerSecond, 60));
+
+    result.loaded = true;
+    result.quirks = cpu.GetQuirkProfile();
+    result.hash = cpu.GetDisplayHash();
+    result.cycles = cpu.GetInstructionCount() - first;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Runs every job on a pool of the given size, returns the wall time of the whole batch
+static double RunBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options, int threads,
+                       std::vector<BatchResult>& results, long long* steals)
+{
+    results.assign(jobs.size(), BatchResult());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    ThreadPool pool(threads);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const BatchJob* job = &jobs[i];
+        BatchResult* result = &results[i];
+        pool.Submit([job, result, &options] { *result = RunJob(*job, options); });
+    }
+    pool.Wait();
+
+    if (steals)
+        *steals = pool.GetStealCount();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static long long TotalCycles(const std::vector<BatchResult>& results)
+{
+    long long cycles = 0;
+    for (size_t i = 0; i < results.size(); i++)
+        cycles += results[i].cycles;
+    return cycles;
+}
+
+static bool ReadJobFile(const char* filename, long long defaultFrames, QuirkProfile defaultQuirks,
+                        std::vector<BatchJob>& jobs)
+{
+    std::ifstream in(filename);
+    if (!in)
+        return false;
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        BatchJob job = { "", defaultFrames, defaultQuirks };
+        std::string quirks;
+
+        if (!(fields >> job.rom) || '#' == job.rom[0])
+            continue;
+        if (fields >> job.frames && fields >> quirks && !Chip8::ParseQuirkProfile(quirks.c_str(), job.quirks))
+        {
+            fprintf(stderr, "Unknown quirk profile %s for %s\n", quirks.c_str(), job.rom.c_str());
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = ThreadPool::GetHardwareThreads();
+    long long frames = 600;
+    int repeat = 1;
+    bool scaling = false;
+    QuirkProfile quirks = QUIRKS_DEFAULT;
+    BatchOptions options = { 700, false };
+    std::vector<std::string> roms;
+    std::vector<std::string> jobFiles;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-f") && i + 1 < argc)
+            frames = atoll(argv[++i]);
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            options.opcodesPerSecond = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-r") && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-l") && i + 1 < argc)
+            jobFiles.push_back(argv[++i]);
+        else if (0 == strcmp(argv[i], "-q") && i + 1 < argc)
+        {
+            if (!Chip8::ParseQuirkProfile(argv[++i], quirks))
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (0 == strcmp(argv[i], "-j"))
+            options.useJit = true;
+        else if (0 == strcmp(argv[i], "-S"))
+            scaling = true;
+        else if ('-' == argv[i][0])
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        else
+            roms.push_back(argv[i]);
+    }
+
+    std::vector<BatchJob> unique;
+    for (size_t i = 0; i < roms.size(); i++)
+    {
+        BatchJob job = { roms[i], frames, quirks };
+        unique.push_back(job);
+    }
+    for (size_t i = 0; i < jobFiles.size(); i++)
+    {
+        if (!ReadJobFile(jobFiles[i].c_str(), frames, quirks, unique))
+        {
+            fprintf(stderr, "Failed to read job file %s\n", jobFiles[i].c_str());
+            return 1;
+        }
+    }
+
+    if (unique.empty() || threads < 1 || repeat < 1)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::vector<BatchJob> jobs;
+    for (int r = 0; r < repeat; r++)
+        jobs.insert(jobs.end(), unique.begin(), unique.end());
+
+    std::vector<BatchResult> results;
+
+    if (!scaling)
+    {
+        long long steals = 0;
+        double seconds = RunBatch(jobs, options, threads, results, &steals);
+
+        int failed = 0;
+        printf("%-6s %-40s %-10s %10s %12s %-16s %10s\n", "job", "rom", "quirks", "frames", "cycles", "hash", "wall ms");
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            const BatchResult& result = results[i];
+            if (!result.loaded)
+            {
+                printf("%-6d %-40s failed to load\n", (int)i, jobs[i].rom.c_str());
+                failed++;
+                continue;
+            }
+            printf("%-6d %-40s %-10s %10lld %12lld %016llx %10.3f\n", (int)i, jobs[i].rom.c_str(),
+                   Chip8::GetQuirkProfileName(result.quirks), jobs[i].frames, result.cycles,
+                   (unsigned long long)result.hash, result.seconds * 1e3);
+        }
+
+        long long cycles = TotalCycles(results);
+        printf("jobs:          %d (%d failed)\n", (int)jobs.size(), failed);
+        printf("threads:       %d\n", threads);
+        printf("elapsed:       %.6f s\n", seconds);
+        printf("throughput:    %.0f instructions/s, %.1f jobs/s\n", cycles / seconds, jobs.size() / seconds);
+        printf("steals:        %lld\n", steals);
+        return failed ? 1 : 0;
+    }
+
+    // 1, 2, 4 ... threads, ending on the requested count
+    std::vector<int> counts;
+    for (int t = 1; t < threads; t *= 2)
+        counts.push_back(t);
+    counts.push_back(threads);
+
+    std::vector<BatchResult> baseline;
+    double baseSeconds = 0;
+    printf("%d jobs, %lld frames each by default\n", (int)jobs.size(), frames);
+    printf("%8s %12s %16s %9s %11s %8s %10s\n", "threads", "wall s", "instructions/s", "speedup", "efficiency", "steals", "mismatches");
+    for (size_t c = 0; c < counts.size(); c++)
+    {
+        long long steals = 0;
+        double seconds = RunBatch(jobs, options, counts[c], results, &steals);
+        if (0 == c)
+        {
+            baseline = results;
+            baseSeconds = seconds;
+        }
+
+        // machines are independent, so every thread count must end in the same state
+        int mismatches = 0;
+        for (size_t i = 0; i < results.size(); i++)
+            if (results[i].loaded != baseline[i].loaded || results[i].hash != baseline[i].hash)
+                mismatches++;
+
+        double speedup = baseSeconds / seconds;
+        printf("%8d %12.6f %16.0f %8.2fx %10.1f%% %8lld %10d\n", counts[c], seconds,
+               TotalCycles(results) / seconds, speedup, 100.0 * speedup / counts[c], steals, mismatches);
+    }
+
+    return 0;
+}
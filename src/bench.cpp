@@ -0,0 +1,307 @@
+#include "chip8.h"
+#include "pacer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// Microbenchmarks for the interpreter core. Runs every ROM given for a fixed
+// number of instructions, then times synthetic programs made of a single
+// class of opcode, and counts the heap allocations made along the way.
+// Prints a table, and with -o writes the same numbers as CSV so a pipeline
+// can track them from build to build.
+//
+// usage: chip8-bench [-n instructions] [-r repeats] [-s opcodes-per-second] [-o csv] rom...
+
+static void PrintUsage(const char* exe)
+{
+    printf("usage: %s [-n instructions] [-r repeats] [-s opcodes-per-second] [-o csv] rom...\n", exe);
+    printf("  -n  instructions per rom and per opcode class (default 20000000)\n");
+    printf("  -r  runs of each, the fastest is reported (default 3)\n");
+    printf("  -s  opcodes executed per second of emulated time (default 700)\n");
+    printf("  -o  also write the results as CSV to this file, - for stdout\n");
+}
+
+// every operator new in the process, to show allocations on the hot path.
+// All C++11 forms are replaced; the sized and aligned forms of later
+// standards fall back to these by default
+static long long s_Allocations = 0;
+static long long s_AllocatedBytes = 0;
+
+static void* CountedAllocate(size_t size)
+{
+    s_Allocations++;
+    s_AllocatedBytes += size;
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size)
+{
+    if (void* memory = CountedAllocate(size))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    if (void* memory = CountedAllocate(size))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedAllocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedAllocate(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+struct BenchResult
+{
+    std::string kind ;    // "rom" or "class"
+    std::string name ;
+    long long instructions ;
+    double seconds ;      // of the fastest run
+    long long allocations ;
+    long long allocatedBytes ;
+};
+
+// A program of one opcode class: the pattern repeated from 0x200 to 0xDFE,
+// then a jump back. The class's stores stay below 0x200, so the program is
+// never invalidated. Memory below 0x200 holds sprite data.
+struct OpcodeClass
+{
+    const char* name ;
+    WORD pattern[12] ;    // ends at the first 0
+};
+
+static const OpcodeClass s_Classes[] =
+{
+    // Opcode8XY*, every ALU operation with changing operands
+    { "8XY*", { 0x8010, 0x8121, 0x8232, 0x8343, 0x8454, 0x8565, 0x8676, 0x8707, 0x801E, 0 } },
+    // OpcodeDXYN, sprites of different heights, some wrapping
+    { "DXYN", { 0xD015, 0xD12F, 0xD23A, 0xD301, 0 } },
+    // Opcode00E0
+    { "00E0", { 0x00E0, 0 } },
+    // OpcodeFX*, all but FX0A which waits for a key; FX29 keeps I in the font area
+    { "FX*", { 0xF007, 0xF015, 0xF018, 0xF11E, 0xF229, 0xF233, 0xF229, 0xF155, 0xF229, 0xF165, 0 } },
+};
+
+static void LoadOpcodeClass(Chip8& cpu, const OpcodeClass& opcodes)
+{
+    Chip8State state;
+    cpu.SaveState(state);
+    for (int address = 0; address < 0x200; address++)
+        state.memory[address] = (BYTE)(address * 37 + 11);
+
+    int length = 0;
+    while (length < 12 && opcodes.pattern[length])
+        length++;
+    const int END = 0xE00 - 2;
+    for (int address = 0x200, i = 0; address < END; address += 2, i = (i + 1) % length)
+    {
+        state.memory[address] = opcodes.pattern[i] >> 8;
+        state.memory[address + 1] = opcodes.pattern[i] & 0xFF;
+    }
+    state.memory[END] = 0x12;
+    state.memory[END + 1] = 0x00;
+
+    static const BYTE registers[16] = { 3, 17, 60, 9, 200, 5, 130, 77, 1, 2, 4, 8, 16, 32, 64, 128 };
+    memcpy(state.registers, registers, sizeof(registers));
+    state.addressI = 0;
+    state.programCounter = 0x200;
+    cpu.LoadState(state);
+}
+
+static double Elapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// runs in frames like chip8-headless, and returns the seconds taken
+static double Run(Chip8& cpu, long long instructions, int opcodesPerSecond)
+{
+    // every instruction counted is one that really ran
+    cpu.EnableIdleSkip(false);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long long executed = 0; executed < instructions; )
+    {
+        int count = FramePacer::GetBudget(executed, opcodesPerSecond, 60);
+        if (instructions - executed < count)
+            count = (int)(instructions - executed);
+        cpu.ExecuteOpcodes(count);
+        executed += count;
+    }
+    return Elapsed(start);
+}
+
+static void PrintResult(const BenchResult& result)
+{
+    printf("%-5s %-40s %12.0f %10.2f %8lld %10lld\n", result.kind.c_str(), result.name.c_str(),
+           result.instructions / result.seconds, result.seconds * 1e9 / result.instructions,
+           result.allocations, result.allocatedBytes);
+}
+
+// A CSV field, quoted with its quotes doubled when it holds a comma or quote
+static std::string CsvField(const std::string& text)
+{
+    if (std::string::npos == text.find_first_of(",\""))
+        return text;
+
+    std::string field = "\"";
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if ('"' == text[i])
+            field += '"';
+        field += text[i];
+    }
+    return field + "\"";
+}
+
+static bool WriteCsv(FILE* out, const std::vector<BenchResult>& results)
+{
+    fprintf(out, "kind,name,dispatch,instructions,seconds,instructions_per_second,ns_per_opcode,allocations,allocated_bytes\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& result = results[i];
+        // rom names can hold commas and quotes
+        std::string name = CsvField(result.name);
+        fprintf(out, "%s,%s,%s,%lld,%.9f,%.0f,%.3f,%lld,%lld\n", result.kind.c_str(), name.c_str(),
+                Chip8::GetDispatchEngine(), result.instructions, result.seconds,
+                result.instructions / result.seconds, result.seconds * 1e9 / result.instructions,
+                result.allocations, result.allocatedBytes);
+    }
+    return 0 == ferror(out);
+}
+
+int main(int argc, char* argv[])
+{
+    long long instructions = 20000000;
+    int repeats = 3;
+    int opcodesPerSecond = 700;
+    std::string csvName;
+    std::vector<std::string> roms;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-n") && i + 1 < argc)
+            instructions = atoll(argv[++i]);
+        else if (0 == strcmp(argv[i], "-r") && i + 1 < argc)
+            repeats = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            opcodesPerSecond = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-o") && i + 1 < argc)
+            csvName = argv[++i];
+        else if ('-' == argv[i][0])
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        else
+            roms.push_back(argv[i]);
+    }
+
+    if (instructions < 1 || repeats < 1)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    printf("dispatch: %s, %lld instructions, best of %d\n", Chip8::GetDispatchEngine(), instructions, repeats);
+    printf("%-5s %-40s %12s %10s %8s %10s\n", "kind", "name", "instr/s", "ns/opcode", "allocs", "bytes");
+
+    // each run starts from a freshly loaded machine, its first decode included
+    for (size_t r = 0; r < roms.size(); r++)
+    {
+        BenchResult result = { "rom", roms[r], instructions, 0, 0, 0 };
+        for (int repeat = 0; repeat < repeats; repeat++)
+        {
+            Chip8 cpu;
+            if (!cpu.LoadRom(roms[r]))
+            {
+                fprintf(stderr, "Failed to load Chip8 ROM %s\n", roms[r].c_str());
+                return 1;
+            }
+
+            long long allocations = s_Allocations;
+            long long allocatedBytes = s_AllocatedBytes;
+            cpu.SetOpcodesPerSecond(opcodesPerSecond);
+            double seconds = Run(cpu, instructions, opcodesPerSecond);
+            if (0 == repeat || seconds < result.seconds)
+                result.seconds = seconds;
+            result.allocations = s_Allocations - allocations;
+            result.allocatedBytes = s_AllocatedBytes - allocatedBytes;
+        }
+        PrintResult(result);
+        results.push_back(result);
+    }
+
+    for (size_t c = 0; c < sizeof(s_Classes) / sizeof(s_Classes[0]); c++)
+    {
+        BenchResult result = { "class", s_Classes[c].name, instructions, 0, 0, 0 };
+        for (int repeat = 0; repeat < repeats; repeat++)
+        {
+            Chip8 cpu;
+            LoadOpcodeClass(cpu, s_Classes[c]);
+
+            long long allocations = s_Allocations;
+            long long allocatedBytes = s_AllocatedBytes;
+            cpu.SetOpcodesPerSecond(opcodesPerSecond);
+            double seconds = Run(cpu, instructions, opcodesPerSecond);
+            if (0 == repeat || seconds < result.seconds)
+                result.seconds = seconds;
+            result.allocations = s_Allocations - allocations;
+            result.allocatedBytes = s_AllocatedBytes - allocatedBytes;
+        }
+        PrintResult(result);
+        results.push_back(result);
+    }
+
+    if (!csvName.empty())
+    {
+        FILE* out = "-" == csvName ? stdout : fopen(csvName.c_str(), "w");
+        if (0 == out)
+        {
+            fprintf(stderr, "Failed to write %s\n", csvName.c_str());
+            return 1;
+        }
+        bool written = WriteCsv(out, results);
+        if (stdout != out)
+            written = 0 == fclose(out) && written;
+        if (!written)
+        {
+            fprintf(stderr, "Failed to write %s\n", csvName.c_str());
+            return 1;
+        }
+    }
+
+    return 0;
+}
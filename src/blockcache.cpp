@@ -0,0 +1,153 @@
+#include "blockcache.h"
+#include "chip8.h"
+#include "fusion.h"
+
+#include <cstring>
+
+// the pool is flushed when it grows past this, e.g. under heavy self-modifying code
+const size_t MAX_BLOCKS = 4096 ;
+
+BlockCache::BlockCache()
+    : m_Fusion(0)
+{
+    Clear() ;
+}
+
+// Blocks compiled from now on use the given superinstructions
+void BlockCache::SetFusion(uint32_t patterns)
+{
+    m_Fusion = patterns ;
+    Clear() ;
+}
+
+void BlockCache::Clear()
+{
+    m_Blocks.clear() ;
+    m_Index.assign(CODE_MEMORY_SIZE, -1) ;
+    memset(m_CodeMap,0,sizeof(m_CodeMap)) ;
+}
+
+// Returns the block starting at address, decoding it first if needed
+Block& BlockCache::Lookup(WORD address, const BYTE* memory, int memorySize)
+{
+    short index = m_Index[address] ;
+    if (index >= 0)
+        return m_Blocks[index] ;
+
+    if (m_Blocks.size() >= MAX_BLOCKS)
+        Clear() ;
+
+    m_Blocks.push_back(Block()) ;
+    Block& block = m_Blocks.back() ;
+    Compile(block, address, memory, memorySize) ;
+
+    m_Index[address] = (short)(m_Blocks.size() - 1) ;
+    for (int i = 0; i < block.length * 2; i++)
+    {
+        int byte = (address + i) % CODE_MEMORY_SIZE ;
+        m_CodeMap[byte / 64] |= 1ULL << (byte % 64) ;
+    }
+
+    return block ;
+}
+
+// Drops every block that overlaps [address, address+length)
+void BlockCache::Invalidate(WORD address, int length)
+{
+    bool overlaps = false ;
+    for (int i = 0; i < length && !overlaps; i++)
+    {
+        int byte = (address + i) % CODE_MEMORY_SIZE ;
+        overlaps = (m_CodeMap[byte / 64] >> (byte % 64)) & 1 ;
+    }
+
+    if (!overlaps)
+        return ;
+
+    // a block covering the write must start at most MAX_BLOCK_LENGTH instructions earlier
+    int first = address - MAX_BLOCK_LENGTH * 2 + 1 ;
+    if (first < 0)
+        first = 0 ;
+
+    for (int start = first; start < address + length && start < CODE_MEMORY_SIZE; start++)
+    {
+        short index = m_Index[start] ;
+        if (index < 0)
+            continue ;
+
+        int end = start + m_Blocks[index].length * 2 ;
+        if (end > address)
+            m_Index[start] = -1 ;
+    }
+}
+
+// Decodes instructions from address until one that can change the
+// program counter or write to memory, or the block is full
+void BlockCache::Compile(Block& block, WORD address, const BYTE* memory, int memorySize)
+{
+    block.start = address ;
+    block.length = 0 ;
+    block.native = 0 ;
+
+    WORD pc = address ;
+    while (block.length < MAX_BLOCK_LENGTH)
+    {
+        // decode enough instructions ahead to match the longest superinstruction
+        Instruction ahead[MAX_FUSION_WIDTH] ;
+        int available = 0 ;
+        int lookahead = m_Fusion ? MAX_FUSION_WIDTH : 1 ;
+        while (available < lookahead && block.length + available < MAX_BLOCK_LENGTH)
+        {
+            int at = pc + available * 2 ;
+            if (at >= memorySize)
+                break ;
+
+            WORD opcode = memory[at] << 8 ;
+            if (at + 1 < memorySize)
+                opcode |= memory[at + 1] ;
+
+            ahead[available++] = Chip8::DecodeInstruction(opcode) ;
+        }
+
+        int pattern = m_Fusion ? MatchFusion(m_Fusion, ahead, available, pc) : -1 ;
+        int width = pattern < 0 ? 1 : g_FusionPatterns[pattern].width ;
+
+        for (int i = 0; i < width; i++)
+            block.ops[block.length + i] = ahead[i] ;
+        if (pattern >= 0)
+            block.ops[block.length].handler = g_FusionPatterns[pattern].fused ;
+
+        block.length += width ;
+        pc += width * 2 ;
+
+        if (EndsBlock(ahead[width - 1].handler) || pc + 1 >= memorySize)
+            break ;
+    }
+}
+
+bool BlockCache::EndsBlock(BYTE handler)
+{
+    switch (handler)
+    {
+        // jumps, calls and returns
+        case OP_00EE:
+        case OP_1NNN:
+        case OP_2NNN:
+        case OP_BNNN:
+        // skips
+        case OP_3XNN:
+        case OP_4XNN:
+        case OP_5XY0:
+        case OP_9XY0:
+        case OP_EX9E:
+        case OP_EXA1:
+        // waits by rewinding the program counter
+        case OP_FX0A:
+        // memory writes may modify the following code
+        case OP_FX33:
+        case OP_FX55:
+            return true ;
+        default:
+            return false ;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "instruction.h"
+
+#include <stdint.h>
+#include <vector>
+
+const int MAX_BLOCK_LENGTH = 32 ;
+const int CODE_MEMORY_SIZE = 0x1000 ;
+
+// A straight-line run of pre-decoded instructions. Only the last
+// instruction may change the program counter or write to memory.
+// A superinstruction is followed in ops by the instructions it replaced.
+struct Block
+{
+    WORD start ;   // address of the first instruction
+    BYTE length ;  // number of instructions in ops
+    const void* native ; // x86-64 translation of the block, filled in by the JIT
+    Instruction ops[MAX_BLOCK_LENGTH] ;
+};
+
+// Cache of decoded blocks keyed by the address they start at
+class BlockCache
+{
+public:
+    BlockCache();
+
+    Block& Lookup(WORD address, const BYTE* memory, int memorySize);
+    void Invalidate(WORD address, int length);
+    void Clear();
+    void SetFusion(uint32_t patterns);
+
+    static bool EndsBlock(BYTE handler);
+
+private:
+    void Compile(Block& block, WORD address, const BYTE* memory, int memorySize);
+
+    std::vector<Block> m_Blocks ;
+    std::vector<short> m_Index ;     // block number for each address, -1 if none
+    uint64_t m_CodeMap[CODE_MEMORY_SIZE / 64] ; // bytes covered by any cached block
+    uint32_t m_Fusion ;               // enabled superinstruction patterns
+};
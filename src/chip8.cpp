@@ -1,30 +1,82 @@
 #include "chip8.h"
+#include "fusion.h"
+#include "jit.h"
+#include "profiler.h"
 #include <assert.h>
 #include <cstring>
 #include <cstdio>
 #include <fstream>
 
-Chip8::Chip8(){}
-
-Chip8* Chip8::s_Instance = 0 ;
-
-Chip8* Chip8::CreateSingleton()
+// sprite rows are drawn two at a time where SSE2 is available, which is
+// every x86-64 build
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Dispatch engine, chosen at build time with one of -DCHIP8_DISPATCH_SWITCH,
+// -DCHIP8_DISPATCH_TABLE, -DCHIP8_DISPATCH_THREADED or -DCHIP8_DISPATCH_BLOCK
+#if !defined(CHIP8_DISPATCH_SWITCH) && !defined(CHIP8_DISPATCH_TABLE) && \
+    !defined(CHIP8_DISPATCH_THREADED) && !defined(CHIP8_DISPATCH_BLOCK)
+#define CHIP8_DISPATCH_SWITCH
+#endif
+
+// computed goto is a GCC/Clang extension, fall back to the table elsewhere
+#if defined(CHIP8_DISPATCH_THREADED) && !defined(__GNUC__)
+#undef CHIP8_DISPATCH_THREADED
+#define CHIP8_DISPATCH_TABLE
+#endif
+
+// Execution counting for ExecutionProfile, compiled in with -DCHIP8_PROFILE
+#if defined(CHIP8_PROFILE)
+#define PROFILE_INSTRUCTION(address, handler) m_Profile->CountInstruction(address, handler)
+#define PROFILE_READS(address, length) m_Profile->CountReads(address, length)
+#define PROFILE_WRITES(address, length) m_Profile->CountWrites(address, length)
+#else
+#define PROFILE_INSTRUCTION(address, handler)
+#define PROFILE_READS(address, length)
+#define PROFILE_WRITES(address, length)
+#endif
+
+Chip8::Chip8()
+    : m_RandomSeed(DEFAULT_RANDOM_SEED)
+    , m_Quirks(QUIRKS_DEFAULT)
+    , m_Handlers(s_Handlers[QUIRKS_DEFAULT])
+    , m_IdleSkip(true)
+    , m_OpcodesPerSecond(DEFAULT_OPCODES_PER_SECOND)
 {
-    if (0 == s_Instance)
-        s_Instance = new Chip8( ) ;
-    return s_Instance;
+    CPUReset();
+    memset(m_Display,0,sizeof(m_Display)) ;
+    m_DirtyRows = ALL_DISPLAY_ROWS ;
+#if defined(CHIP8_PROFILE)
+    m_Profile.reset(new ExecutionProfile());
+#endif
 }
 
+// defined here so the Jit type is complete for m_Jit
 Chip8::~Chip8(){}
 
+// The JIT addresses the guest state relative to the object it is given,
+// so translations stay valid when a machine moves
+Chip8::Chip8(Chip8&& other) = default;
+Chip8& Chip8::operator=(Chip8&& other) = default;
+
 void Chip8::CPUReset() {
+    m_InstructionCount = 0;
+    m_IdleSkipped = 0;
+    m_RandomState = SeedRandom(m_RandomSeed);
     m_AddressI = 0;
     m_ProgramCounter = 0x200 ;
     memset(m_Registers,0,sizeof(m_Registers)) ;
     memset(m_GameMemory,0,sizeof(m_GameMemory)) ;
+    // every machine starts from the same empty memory, so hash it once
+    static const uint64_t emptyMemoryHash = HashMemoryWords(0, sizeof(m_GameMemory)) ;
+    m_MemoryHash = emptyMemoryHash ;
+    memset(m_Stack,0,sizeof(m_Stack)) ;
+    m_StackPointer = 0 ;
 	memset(m_KeyState,0,sizeof(m_KeyState)) ;
-	m_DelayTimer = 0 ;
-	m_SoundTimer = 0 ;
+	m_DelayExpiry = 0 ;
+	m_SoundExpiry = 0 ;
+	m_Tick = 0 ;
 }                         
 
 WORD Chip8::GetNextOpcode()
@@ -39,10 +91,16 @@ WORD Chip8::GetNextOpcode()
 }
 
 
-bool Chip8::LoadRom(const std::string& romname)
+bool Chip8::LoadRom(const std::string& romname, QuirkProfile quirks)
 {
     CPUReset() ;
-	Opcode00E0() ;
+    m_Quirks = quirks ;
+    m_Handlers = s_Handlers[quirks] ;
+	memset(m_Display,0,sizeof(m_Display)) ;
+	m_DirtyRows = ALL_DISPLAY_ROWS ;
+	m_BlockCache.Clear() ;
+    if (m_Profile)
+        m_Profile->Clear() ;
 
     //load in the game
     FILE* in ;
@@ -54,8 +112,9 @@ bool Chip8::LoadRom(const std::string& romname)
         return false ;
     }
 
-    fread(&m_GameMemory[0x200], ROMSIZE, 1, in) ;
+    fread(&m_GameMemory[0x200], 1, sizeof(m_GameMemory) - 0x200, in) ;
     fclose(in) ;
+    RehashMemory() ;
 
     return true ;
 }
@@ -70,21 +129,38 @@ void Chip8::KeyReleased(int key)
     m_KeyState[key] = 0;
 }
 
-void Chip8::DecreaseTimers()
+bool Chip8::IsKeyPressed(int key) const
 {
-    if (m_DelayTimer > 0)
-		m_DelayTimer-- ;
+    return m_KeyState[key] != 0;
+}
 
-	if (m_SoundTimer > 0)
-		m_SoundTimer--;
+// The value a timer that reaches zero on expiry shows at tick
+static BYTE GetTimerValue(uint64_t expiry, uint64_t tick)
+{
+    return expiry > tick ? (BYTE)(expiry - tick) : 0;
+}
 
-	if (m_SoundTimer > 0)
-		PlaySound( ) ;
+// Tick k falls on instruction k * opcodesPerSecond / TIMER_HZ, rounded
+// down, the same boundaries as FramePacer::GetBudget's frames at 60Hz.
+// An instruction on a boundary already sees that tick
+uint64_t Chip8::GetTimerTicks(uint64_t instructionCount, int opcodesPerSecond)
+{
+    return (instructionCount * TIMER_HZ + opcodesPerSecond - 1) / opcodesPerSecond;
 }
 
-void Chip8::PlaySound()
+void Chip8::SetOpcodesPerSecond(int opcodesPerSecond)
 {
+    BYTE delay = GetDelayTimer();
+    BYTE sound = GetSoundTimer();
+    m_OpcodesPerSecond = opcodesPerSecond > 0 ? opcodesPerSecond : DEFAULT_OPCODES_PER_SECOND;
+    uint64_t now = GetTimerTicks(m_InstructionCount, m_OpcodesPerSecond);
+    m_DelayExpiry = now + delay;
+    m_SoundExpiry = now + sound;
+}
 
+int Chip8::GetOpcodesPerSecond() const
+{
+    return m_OpcodesPerSecond;
 }
 
 int Chip8::GetKeyPressed( )
@@ -108,345 +184,1231 @@ WORD Chip8::GetProgramCounter()
     return m_ProgramCounter;
 }
 
+WORD Chip8::GetAddressI() const
+{
+    return m_AddressI;
+}
+
+const BYTE* Chip8::GetRegisters() const
+{
+    return m_Registers;
+}
+
+// between instructions, before the tick on the next one if it has one
+BYTE Chip8::GetDelayTimer() const
+{
+    return GetTimerValue(m_DelayExpiry, GetTimerTicks(m_InstructionCount, m_OpcodesPerSecond));
+}
+
+BYTE Chip8::GetSoundTimer() const
+{
+    return GetTimerValue(m_SoundExpiry, GetTimerTicks(m_InstructionCount, m_OpcodesPerSecond));
+}
+
+const uint64_t* Chip8::GetDisplay() const
+{
+    return m_Display;
+}
+
+uint64_t Chip8::GetDisplayHash() const
+{
+    return HashDisplay(m_Display);
+}
+
+bool Chip8::IsDisplayDirty() const
+{
+    return 0 != m_DirtyRows;
+}
+
+uint32_t Chip8::TakeDirtyRows()
+{
+    uint32_t rows = m_DirtyRows;
+    m_DirtyRows = 0;
+    return rows;
+}
+
+// FNV-1a over the display rows, used to compare runs
+uint64_t Chip8::HashDisplay(const uint64_t* display)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const BYTE* bytes = reinterpret_cast<const BYTE*>(display);
+    for (size_t i = 0; i < DISPLAY_HEIGHT * sizeof(uint64_t); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+long long Chip8::GetInstructionCount() const
+{
+    return (long long)m_InstructionCount;
+}
+
+QuirkProfile Chip8::GetQuirkProfile() const
+{
+    return m_Quirks;
+}
+
+// Decoded blocks do not depend on the profile, only the handler table does
+void Chip8::SetQuirkProfile(QuirkProfile quirks)
+{
+    m_Quirks = quirks;
+    m_Handlers = s_Handlers[quirks];
+}
+
+void Chip8::SetRandomSeed(uint64_t seed)
+{
+    m_RandomSeed = seed;
+    m_RandomState = SeedRandom(seed);
+}
+
+uint64_t Chip8::GetRandomSeed() const
+{
+    return m_RandomSeed;
+}
+
+void Chip8::SaveState(Chip8State& state) const
+{
+    // zero the padding too, so equal machines give equal bytes
+    memset(&state, 0, sizeof(state));
+    memcpy(state.display, m_Display, sizeof(m_Display));
+    state.instructionCount = m_InstructionCount;
+    state.randomState = m_RandomState;
+    memcpy(state.registers, m_Registers, sizeof(m_Registers));
+    memcpy(state.memory, m_GameMemory, sizeof(m_GameMemory));
+    state.addressI = m_AddressI;
+    state.programCounter = m_ProgramCounter;
+    state.delayTimer = GetDelayTimer();
+    state.soundTimer = GetSoundTimer();
+    memcpy(state.stack, m_Stack, sizeof(m_Stack));
+    state.stackPointer = m_StackPointer;
+}
+
+void Chip8::LoadState(const Chip8State& state)
+{
+    // only drop the decoded blocks over memory the state changes
+    const int CHUNK = 64;
+    for (int address = 0; address < (int)sizeof(m_GameMemory); address += CHUNK)
+    {
+        if (0 != memcmp(&m_GameMemory[address], &state.memory[address], CHUNK))
+            m_BlockCache.Invalidate(address, CHUNK);
+    }
+
+    memcpy(m_Display, state.display, sizeof(m_Display));
+    m_DirtyRows = ALL_DISPLAY_ROWS;
+    m_InstructionCount = state.instructionCount;
+    // a zero state would only ever give zeros
+    m_RandomState = state.randomState ? state.randomState : SeedRandom(m_RandomSeed);
+    memcpy(m_Registers, state.registers, sizeof(m_Registers));
+    memcpy(m_GameMemory, state.memory, sizeof(m_GameMemory));
+    RehashMemory();
+    m_AddressI = state.addressI;
+    m_ProgramCounter = state.programCounter;
+    uint64_t now = GetTimerTicks(m_InstructionCount, m_OpcodesPerSecond);
+    m_DelayExpiry = now + state.delayTimer;
+    m_SoundExpiry = now + state.soundTimer;
+    memcpy(m_Stack, state.stack, sizeof(m_Stack));
+    m_StackPointer = state.stackPointer & 0xF;
+}
+
+Chip8 Chip8::Clone() const
+{
+    Chip8 copy;
+    copy.CopyState(*this);
+    return copy;
+}
+
+void Chip8::CopyStateFrom(const Chip8& other)
+{
+    // siblings share most of their memory, so only copy, and drop the
+    // decoded blocks over, the chunks that differ
+    const int CHUNK = 64;
+    for (int address = 0; address < (int)sizeof(m_GameMemory); address += CHUNK)
+    {
+        if (0 != memcmp(&m_GameMemory[address], &other.m_GameMemory[address], CHUNK))
+        {
+            m_BlockCache.Invalidate(address, CHUNK);
+            memcpy(&m_GameMemory[address], &other.m_GameMemory[address], CHUNK);
+        }
+    }
+    m_MemoryHash = other.m_MemoryHash;
+    CopyRegisters(other);
+}
+
+// The guest machine only, the caches stay with each object
+void Chip8::CopyState(const Chip8& other)
+{
+    memcpy(m_GameMemory, other.m_GameMemory, sizeof(m_GameMemory));
+    m_MemoryHash = other.m_MemoryHash;
+    CopyRegisters(other);
+}
+
+void Chip8::CopyRegisters(const Chip8& other)
+{
+    memcpy(m_Registers, other.m_Registers, sizeof(m_Registers));
+    m_AddressI = other.m_AddressI;
+    m_ProgramCounter = other.m_ProgramCounter;
+    m_InstructionCount = other.m_InstructionCount;
+    m_RandomSeed = other.m_RandomSeed;
+    m_RandomState = other.m_RandomState;
+    m_Quirks = other.m_Quirks;
+    m_Handlers = other.m_Handlers;
+    m_IdleSkip = other.m_IdleSkip;
+    memcpy(m_Stack, other.m_Stack, sizeof(m_Stack));
+    m_StackPointer = other.m_StackPointer;
+    memcpy(m_KeyState, other.m_KeyState, sizeof(m_KeyState));
+    m_DelayExpiry = other.m_DelayExpiry;
+    m_SoundExpiry = other.m_SoundExpiry;
+    m_OpcodesPerSecond = other.m_OpcodesPerSecond;
+    memcpy(m_Display, other.m_Display, sizeof(m_Display));
+    m_DirtyRows = ALL_DISPLAY_ROWS;
+}
+
+// Memory is hashed as the XOR of one mixed value per 8-byte word, so a
+// store only has to swap out the values of the words it touches
+static uint64_t MixMemoryWord(int index, uint64_t word)
+{
+    uint64_t hash = word ^ (index * 0x9E3779B97F4A7C15ULL + 0x632BE59BD9B4E019ULL);
+    hash = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDULL;
+    hash = (hash ^ (hash >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    return hash ^ (hash >> 33);
+}
+
+// XOR of the mixed values of every word overlapping [address, address+length)
+uint64_t Chip8::HashMemoryWords(int address, int length) const
+{
+    const int WORDS = sizeof(m_GameMemory) / 8;
+    uint64_t hash = 0;
+    for (int index = address / 8; index <= (address + length - 1) / 8 && index < WORDS; index++)
+    {
+        uint64_t word;
+        memcpy(&word, &m_GameMemory[index * 8], sizeof(word));
+        hash ^= MixMemoryWord(index, word);
+    }
+    return hash;
+}
+
+void Chip8::RehashMemory()
+{
+    m_MemoryHash = HashMemoryWords(0, sizeof(m_GameMemory));
+}
+
+// Four independent multiply chains over 64-bit words, so the multiplies
+// overlap, folded with a final avalanche. size must be a multiple of 32.
+static uint64_t HashWords(const BYTE* bytes, size_t size, uint64_t seed)
+{
+    const uint64_t PRIME = 0x9E3779B97F4A7C15ULL;
+    uint64_t a = seed, b = seed ^ 0x2545F4914F6CDD1DULL, c = seed + PRIME, d = ~seed;
+    for (size_t i = 0; i < size; i += 32)
+    {
+        uint64_t words[4];
+        memcpy(words, bytes + i, sizeof(words));
+        a = (a ^ words[0]) * PRIME;
+        b = (b ^ words[1]) * PRIME;
+        c = (c ^ words[2]) * PRIME;
+        d = (d ^ words[3]) * PRIME;
+        a ^= a >> 29;
+        b ^= b >> 29;
+        c ^= c >> 29;
+        d ^= d >> 29;
+    }
+
+    uint64_t hash = a ^ (b << 16 | b >> 48) ^ (c << 32 | c >> 32) ^ (d << 48 | d >> 16);
+    hash = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDULL;
+    hash = (hash ^ (hash >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    return hash ^ (hash >> 33);
+}
+
+// Leaves out the instruction count, the same state reached at different times is a duplicate
+uint64_t Chip8::GetStateHash() const
+{
+    // the small fields packed into 64 bytes. Keys are left out like in
+    // Chip8State, the caller sets them before the machine runs again
+    BYTE packed[64];
+    memset(packed, 0, sizeof(packed));
+    memcpy(packed, m_Registers, 16);
+    memcpy(packed + 16, m_Stack, 32);
+    memcpy(packed + 48, &m_AddressI, 2);
+    memcpy(packed + 50, &m_ProgramCounter, 2);
+    packed[52] = m_StackPointer;
+    packed[53] = GetDelayTimer();
+    packed[54] = GetSoundTimer();
+    packed[55] = (BYTE)m_Quirks;
+    memcpy(packed + 56, &m_RandomState, 8);
+
+    uint64_t hash = HashWords(reinterpret_cast<const BYTE*>(m_Display), sizeof(m_Display), m_MemoryHash);
+    return HashWords(packed, sizeof(packed), hash);
+}
+
+static const char* const s_QuirkProfileNames[QUIRK_PROFILE_COUNT] =
+{
+    "default", "cosmac", "superchip"
+};
+
+const char* Chip8::GetQuirkProfileName(QuirkProfile quirks)
+{
+    return quirks < QUIRK_PROFILE_COUNT ? s_QuirkProfileNames[quirks] : "unknown";
+}
+
+bool Chip8::ParseQuirkProfile(const char* name, QuirkProfile& quirks)
+{
+    for (int i = 0; i < QUIRK_PROFILE_COUNT; i++)
+    {
+        if (0 == strcmp(name, s_QuirkProfileNames[i]))
+        {
+            quirks = static_cast<QuirkProfile>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* Chip8::GetDispatchEngine()
+{
+#if defined(CHIP8_DISPATCH_SWITCH)
+    return "switch";
+#elif defined(CHIP8_DISPATCH_TABLE)
+    return "table";
+#elif defined(CHIP8_DISPATCH_BLOCK)
+    return "block";
+#else
+    return "threaded";
+#endif
+}
+
+// Table of opcode handlers, indexed by OpcodeId
+template <class Quirks>
+const Chip8::OpcodeHandler Chip8::HandlerTable<Quirks>::s_Handlers[OP_COUNT] =
+{
+    &Chip8::Opcode00E0, &Chip8::Opcode00EE, &Chip8::Opcode1NNN, &Chip8::Opcode2NNN,
+    &Chip8::Opcode3XNN, &Chip8::Opcode4XNN, &Chip8::Opcode5XY0, &Chip8::Opcode6XNN,
+    &Chip8::Opcode7XNN, &Chip8::Opcode8XY0, &Chip8::Opcode8XY1, &Chip8::Opcode8XY2,
+    &Chip8::Opcode8XY3, &Chip8::Opcode8XY4, &Chip8::Opcode8XY5, &Chip8::Opcode8XY6<Quirks>,
+    &Chip8::Opcode8XY7, &Chip8::Opcode8XYE<Quirks>, &Chip8::Opcode9XY0, &Chip8::OpcodeANNN,
+    &Chip8::OpcodeBNNN<Quirks>, &Chip8::OpcodeCXNN, &Chip8::OpcodeDXYN<Quirks>, &Chip8::OpcodeEX9E,
+    &Chip8::OpcodeEXA1, &Chip8::OpcodeFX07, &Chip8::OpcodeFX0A, &Chip8::OpcodeFX15,
+    &Chip8::OpcodeFX18, &Chip8::OpcodeFX1E, &Chip8::OpcodeFX29, &Chip8::OpcodeFX33,
+    &Chip8::OpcodeFX55<Quirks>, &Chip8::OpcodeFX65<Quirks>, &Chip8::OpcodeNone,
+    &Chip8::Opcode6XNN_6XNN, &Chip8::Opcode7XNN_7XNN, &Chip8::OpcodeANNN_DXYN<Quirks>,
+    &Chip8::Opcode7XNN_3XNN_1NNN, &Chip8::OpcodeFX07_3XNN_1NNN
+};
+
+// Handler tables indexed by QuirkProfile
+const Chip8::OpcodeHandler* const Chip8::s_Handlers[QUIRK_PROFILE_COUNT] =
+{
+    HandlerTable<DefaultQuirks>::s_Handlers,
+    HandlerTable<CosmacQuirks>::s_Handlers,
+    HandlerTable<SuperChipQuirks>::s_Handlers
+};
+
+// Printable names, indexed by OpcodeId
+static const char* const s_OpcodeNames[OP_COUNT] =
+{
+    "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN",
+    "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6",
+    "8XY7", "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E",
+    "EXA1", "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33",
+    "FX55", "FX65", "NONE",
+    "6XNN+6XNN", "7XNN+7XNN", "ANNN+DXYN", "7XNN+3XNN+1NNN", "FX07+3XNN+1NNN"
+};
+
+const char* Chip8::GetOpcodeName(BYTE handler)
+{
+    return handler < OP_COUNT ? s_OpcodeNames[handler] : "????";
+}
+
+Instruction Chip8::s_DecodeTable[0x10000] ;
+
+// Splits an opcode into its operand fields and works out which handler runs it.
+// Unknown opcodes decode to OP_NONE and are ignored.
+Instruction Chip8::DecodeInstruction(WORD opcode)
+{
+    Instruction ins ;
+    ins.x = (opcode & 0x0F00) >> 8 ;
+    ins.y = (opcode & 0x00F0) >> 4 ;
+    ins.n = opcode & 0x000F ;
+    ins.nn = opcode & 0x00FF ;
+    ins.nnn = opcode & 0x0FFF ;
+    ins.handler = OP_NONE ;
+
+    switch(opcode & 0xF000)
+    {
+        case 0x0000:
+            switch(ins.n)
+            {
+                case 0x0: ins.handler = OP_00E0; break;
+                case 0xE: ins.handler = OP_00EE; break;
+                default: break;
+            }
+            break;
+        case 0x1000: ins.handler = OP_1NNN; break;
+        case 0x2000: ins.handler = OP_2NNN; break;
+        case 0x3000: ins.handler = OP_3XNN; break;
+        case 0x4000: ins.handler = OP_4XNN; break;
+        case 0x5000: ins.handler = OP_5XY0; break;
+        case 0x6000: ins.handler = OP_6XNN; break;
+        case 0x7000: ins.handler = OP_7XNN; break;
+        case 0x8000:
+            switch(ins.n)
+            {
+                case 0x0: ins.handler = OP_8XY0; break;
+                case 0x1: ins.handler = OP_8XY1; break;
+                case 0x2: ins.handler = OP_8XY2; break;
+                case 0x3: ins.handler = OP_8XY3; break;
+                case 0x4: ins.handler = OP_8XY4; break;
+                case 0x5: ins.handler = OP_8XY5; break;
+                case 0x6: ins.handler = OP_8XY6; break;
+                case 0x7: ins.handler = OP_8XY7; break;
+                case 0xE: ins.handler = OP_8XYE; break;
+                default: break;
+            }
+            break;
+        case 0x9000: ins.handler = OP_9XY0; break;
+        case 0xA000: ins.handler = OP_ANNN; break;
+        case 0xB000: ins.handler = OP_BNNN; break;
+        case 0xC000: ins.handler = OP_CXNN; break;
+        case 0xD000: ins.handler = OP_DXYN; break;
+        case 0xE000:
+            switch(ins.n)
+            {
+                case 0xE: ins.handler = OP_EX9E; break;
+                case 0x1: ins.handler = OP_EXA1; break;
+                default: break;
+            }
+            break;
+        case 0xF000:
+            switch(ins.nn)
+            {
+                case 0x07: ins.handler = OP_FX07; break;
+                case 0x0A: ins.handler = OP_FX0A; break;
+                case 0x15: ins.handler = OP_FX15; break;
+                case 0x18: ins.handler = OP_FX18; break;
+                case 0x1E: ins.handler = OP_FX1E; break;
+                case 0x29: ins.handler = OP_FX29; break;
+                case 0x33: ins.handler = OP_FX33; break;
+                case 0x55: ins.handler = OP_FX55; break;
+                case 0x65: ins.handler = OP_FX65; break;
+                default: break;
+            }
+            break;
+        default : break;
+    }
+
+    return ins ;
+}
+
+// Precomputes the decoded form of every possible opcode
+bool Chip8::BuildDecodeTable()
+{
+    for (int opcode = 0; opcode < 0x10000; opcode++)
+        s_DecodeTable[opcode] = DecodeInstruction(opcode) ;
+    return true ;
+}
+
+const bool Chip8::s_DecodeTableBuilt = Chip8::BuildDecodeTable() ;
+
+#if defined(CHIP8_DISPATCH_SWITCH)
+
+// Each quirk profile gets its own copy of the switch
 void Chip8::ExecuteNextOpcode()
+{
+    BeginSlice(1);
+    switch (m_Quirks)
+    {
+        case QUIRKS_COSMAC: ExecuteNextOpcodeWith<CosmacQuirks>(); break;
+        case QUIRKS_SUPERCHIP: ExecuteNextOpcodeWith<SuperChipQuirks>(); break;
+        default: ExecuteNextOpcodeWith<DefaultQuirks>(); break;
+    }
+}
+
+// Switches on the top nibble, then on the low bits for the grouped opcodes
+template <class Quirks>
+void Chip8::ExecuteNextOpcodeWith()
 {
     WORD opcode = GetNextOpcode();
+    PROFILE_INSTRUCTION(m_ProgramCounter - 2, s_DecodeTable[opcode].handler);
+
+    Instruction ins ;
+    ins.x = (opcode & 0x0F00) >> 8 ;
+    ins.y = (opcode & 0x00F0) >> 4 ;
+    ins.n = opcode & 0x000F ;
+    ins.nn = opcode & 0x00FF ;
+    ins.nnn = opcode & 0x0FFF ;
 
     switch(opcode & 0xF000)
     {
-        case 0x0000: DecodeOpcode00(opcode); break;
-        case 0x1000: Opcode1NNN(opcode); break;
-        case 0x2000: Opcode2NNN(opcode); break;
-        case 0x3000: Opcode3XNN(opcode); break;
-        case 0x4000: Opcode4XNN(opcode); break;
-        case 0x5000: Opcode5XY0(opcode); break;
-        case 0x6000: Opcode6XNN(opcode); break;
-        case 0x7000: Opcode7XNN(opcode); break;
-        case 0x8000: DecodeOpcode8(opcode); break;
-        case 0x9000: Opcode9XY0(opcode); break;
-        case 0xA000: OpcodeANNN(opcode); break;
-        case 0xB000: OpcodeBNNN(opcode); break;
-        case 0xC000: OpcodeCXNN(opcode); break;
-        case 0xD000: OpcodeDXYN(opcode); break;
-        case 0xE000: DecodeOpcodeE(opcode); break;
-        case 0xF000: DecodeOpcodeF(opcode); break;
+        case 0x0000: DecodeOpcode00(ins); break;
+        case 0x1000: Opcode1NNN(ins); break;
+        case 0x2000: Opcode2NNN(ins); break;
+        case 0x3000: Opcode3XNN(ins); break;
+        case 0x4000: Opcode4XNN(ins); break;
+        case 0x5000: Opcode5XY0(ins); break;
+        case 0x6000: Opcode6XNN(ins); break;
+        case 0x7000: Opcode7XNN(ins); break;
+        case 0x8000: DecodeOpcode8<Quirks>(ins); break;
+        case 0x9000: Opcode9XY0(ins); break;
+        case 0xA000: OpcodeANNN(ins); break;
+        case 0xB000: OpcodeBNNN<Quirks>(ins); break;
+        case 0xC000: OpcodeCXNN(ins); break;
+        case 0xD000: OpcodeDXYN<Quirks>(ins); break;
+        case 0xE000: DecodeOpcodeE(ins); break;
+        case 0xF000: DecodeOpcodeF<Quirks>(ins); break;
         default : break;
     }
 }
 
+// The quirk profile is looked at once per call, not once per opcode
+void Chip8::InterpretOpcodes(int count)
+{
+    switch (m_Quirks)
+    {
+        case QUIRKS_COSMAC: InterpretOpcodesWith<CosmacQuirks>(count); break;
+        case QUIRKS_SUPERCHIP: InterpretOpcodesWith<SuperChipQuirks>(count); break;
+        default: InterpretOpcodesWith<DefaultQuirks>(count); break;
+    }
+}
+
+template <class Quirks>
+void Chip8::InterpretOpcodesWith(int count)
+{
+    for (int i = 0; i < count; i++)
+        ExecuteNextOpcodeWith<Quirks>();
+}
 
-void Chip8::DecodeOpcode00(WORD opcode){
-    switch(opcode & 0xF)
+void Chip8::DecodeOpcode00(const Instruction& ins){
+    switch(ins.n)
     {
-        case 0x0: Opcode00E0(); break;
-        case 0xE: Opcode00EE(); break;
+        case 0x0: Opcode00E0(ins); break;
+        case 0xE: Opcode00EE(ins); break;
         default: break;
-    }           
+    }
 }
 
-void Chip8::DecodeOpcode8(WORD opcode)
+template <class Quirks>
+void Chip8::DecodeOpcode8(const Instruction& ins)
 {
-    switch (opcode & 0xF)
+    switch (ins.n)
     {
-        case 0x0: Opcode8XY0(opcode); break;
-        case 0x1: Opcode8XY1(opcode); break;
-        case 0x2: Opcode8XY2(opcode); break;
-        case 0x3: Opcode8XY3(opcode); break;
-        case 0x4: Opcode8XY4(opcode); break;
-        case 0x5: Opcode8XY5(opcode); break;
-        case 0x6: Opcode8XY6(opcode); break;
-        case 0x7: Opcode8XY7(opcode); break;
-        case 0xE: Opcode8XYE(opcode); break;
+        case 0x0: Opcode8XY0(ins); break;
+        case 0x1: Opcode8XY1(ins); break;
+        case 0x2: Opcode8XY2(ins); break;
+        case 0x3: Opcode8XY3(ins); break;
+        case 0x4: Opcode8XY4(ins); break;
+        case 0x5: Opcode8XY5(ins); break;
+        case 0x6: Opcode8XY6<Quirks>(ins); break;
+        case 0x7: Opcode8XY7(ins); break;
+        case 0xE: Opcode8XYE<Quirks>(ins); break;
         default: break;
     }
 }
 
-void Chip8::DecodeOpcodeE(WORD opcode)
+void Chip8::DecodeOpcodeE(const Instruction& ins)
 {
-    switch(opcode & 0xF)
+    switch(ins.n)
     {
-        case 0xE: OpcodeEX9E(opcode); break;
-        case 0x1: OpcodeEXA1(opcode); break;
+        case 0xE: OpcodeEX9E(ins); break;
+        case 0x1: OpcodeEXA1(ins); break;
         default: break;
     }
 }
 
-void Chip8::DecodeOpcodeF(WORD opcode)
+template <class Quirks>
+void Chip8::DecodeOpcodeF(const Instruction& ins)
 {
-    switch(opcode & 0xFF)
+    switch(ins.nn)
     {
-        case 0x07: OpcodeFX07(opcode); break;
-        case 0x0A: OpcodeFX0A(opcode); break;
-        case 0x15: OpcodeFX15(opcode); break;
-        case 0x18: OpcodeFX18(opcode); break;
-        case 0x1E: OpcodeFX1E(opcode); break;
-        case 0x29: OpcodeFX29(opcode); break;
-        case 0x33: OpcodeFX33(opcode); break;
-        case 0x55: OpcodeFX55(opcode); break;
-        case 0x65: OpcodeFX65(opcode); break;
+        case 0x07: OpcodeFX07(ins); break;
+        case 0x0A: OpcodeFX0A(ins); break;
+        case 0x15: OpcodeFX15(ins); break;
+        case 0x18: OpcodeFX18(ins); break;
+        case 0x1E: OpcodeFX1E(ins); break;
+        case 0x29: OpcodeFX29(ins); break;
+        case 0x33: OpcodeFX33(ins); break;
+        case 0x55: OpcodeFX55<Quirks>(ins); break;
+        case 0x65: OpcodeFX65<Quirks>(ins); break;
         default: break;
     }
 }
 
-// Clear the screen
-void Chip8::Opcode00E0 ()
+#elif defined(CHIP8_DISPATCH_TABLE)
+
+void Chip8::ExecuteNextOpcode()
 {
-    for(int x =0;x<640;x++)
+    BeginSlice(1);
+    InterpretOpcodes(1);
+}
+
+// One lookup in the precomputed decode table and one indirect call
+void Chip8::InterpretOpcodes(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const Instruction& ins = s_DecodeTable[GetNextOpcode()];
+        PROFILE_INSTRUCTION(m_ProgramCounter - 2, ins.handler);
+        (this->*m_Handlers[ins.handler])(ins);
+    }
+}
+
+#elif defined(CHIP8_DISPATCH_THREADED)
+
+void Chip8::ExecuteNextOpcode()
+{
+    BeginSlice(1);
+    InterpretOpcodes(1);
+}
+
+// The quirk profile is looked at once per call, not once per opcode
+void Chip8::InterpretOpcodes(int count)
+{
+    switch (m_Quirks)
+    {
+        case QUIRKS_COSMAC: InterpretOpcodesWith<CosmacQuirks>(count); break;
+        case QUIRKS_SUPERCHIP: InterpretOpcodesWith<SuperChipQuirks>(count); break;
+        default: InterpretOpcodesWith<DefaultQuirks>(count); break;
+    }
+}
+
+// Threaded interpreter using the GCC/Clang labels-as-values extension.
+// Every handler ends in its own indirect jump to the next one, which gives
+// the branch predictor one history per opcode instead of a single shared site.
+template <class Quirks>
+void Chip8::InterpretOpcodesWith(int count)
+{
+    static void* const labels[OP_COUNT] =
+    {
+        &&op_00E0, &&op_00EE, &&op_1NNN, &&op_2NNN, &&op_3XNN, &&op_4XNN,
+        &&op_5XY0, &&op_6XNN, &&op_7XNN, &&op_8XY0, &&op_8XY1, &&op_8XY2,
+        &&op_8XY3, &&op_8XY4, &&op_8XY5, &&op_8XY6, &&op_8XY7, &&op_8XYE,
+        &&op_9XY0, &&op_ANNN, &&op_BNNN, &&op_CXNN, &&op_DXYN, &&op_EX9E,
+        &&op_EXA1, &&op_FX07, &&op_FX0A, &&op_FX15, &&op_FX18, &&op_FX1E,
+        &&op_FX29, &&op_FX33, &&op_FX55, &&op_FX65, &&op_NONE,
+        // superinstructions never come out of the decode table
+        &&op_NONE, &&op_NONE, &&op_NONE, &&op_NONE, &&op_NONE
+    };
+
+    const Instruction* ins ;
+
+#define DISPATCH() \
+    if (count-- <= 0) return ; \
+    ins = &s_DecodeTable[GetNextOpcode()] ; \
+    PROFILE_INSTRUCTION(m_ProgramCounter - 2, ins->handler) ; \
+    goto *labels[ins->handler]
+
+    DISPATCH();
+
+    op_00E0: Opcode00E0(*ins); DISPATCH();
+    op_00EE: Opcode00EE(*ins); DISPATCH();
+    op_1NNN: Opcode1NNN(*ins); DISPATCH();
+    op_2NNN: Opcode2NNN(*ins); DISPATCH();
+    op_3XNN: Opcode3XNN(*ins); DISPATCH();
+    op_4XNN: Opcode4XNN(*ins); DISPATCH();
+    op_5XY0: Opcode5XY0(*ins); DISPATCH();
+    op_6XNN: Opcode6XNN(*ins); DISPATCH();
+    op_7XNN: Opcode7XNN(*ins); DISPATCH();
+    op_8XY0: Opcode8XY0(*ins); DISPATCH();
+    op_8XY1: Opcode8XY1(*ins); DISPATCH();
+    op_8XY2: Opcode8XY2(*ins); DISPATCH();
+    op_8XY3: Opcode8XY3(*ins); DISPATCH();
+    op_8XY4: Opcode8XY4(*ins); DISPATCH();
+    op_8XY5: Opcode8XY5(*ins); DISPATCH();
+    op_8XY6: Opcode8XY6<Quirks>(*ins); DISPATCH();
+    op_8XY7: Opcode8XY7(*ins); DISPATCH();
+    op_8XYE: Opcode8XYE<Quirks>(*ins); DISPATCH();
+    op_9XY0: Opcode9XY0(*ins); DISPATCH();
+    op_ANNN: OpcodeANNN(*ins); DISPATCH();
+    op_BNNN: OpcodeBNNN<Quirks>(*ins); DISPATCH();
+    op_CXNN: OpcodeCXNN(*ins); DISPATCH();
+    op_DXYN: OpcodeDXYN<Quirks>(*ins); DISPATCH();
+    op_EX9E: OpcodeEX9E(*ins); DISPATCH();
+    op_EXA1: OpcodeEXA1(*ins); DISPATCH();
+    op_FX07: OpcodeFX07(*ins); DISPATCH();
+    op_FX0A: OpcodeFX0A(*ins); DISPATCH();
+    op_FX15: OpcodeFX15(*ins); DISPATCH();
+    op_FX18: OpcodeFX18(*ins); DISPATCH();
+    op_FX1E: OpcodeFX1E(*ins); DISPATCH();
+    op_FX29: OpcodeFX29(*ins); DISPATCH();
+    op_FX33: OpcodeFX33(*ins); DISPATCH();
+    op_FX55: OpcodeFX55<Quirks>(*ins); DISPATCH();
+    op_FX65: OpcodeFX65<Quirks>(*ins); DISPATCH();
+    op_NONE: DISPATCH();
+
+#undef DISPATCH
+}
+
+#elif defined(CHIP8_DISPATCH_BLOCK)
+
+void Chip8::ExecuteNextOpcode()
+{
+    BeginSlice(1);
+    const Instruction& ins = s_DecodeTable[GetNextOpcode()];
+    PROFILE_INSTRUCTION(m_ProgramCounter - 2, ins.handler);
+    (this->*m_Handlers[ins.handler])(ins);
+}
+
+// Runs whole pre-decoded blocks from the block cache, so instructions
+// are only fetched and decoded the first time their block is reached
+void Chip8::InterpretOpcodes(int count)
+{
+    while (count > 0)
+    {
+        // swap in superinstructions once the profile is complete
+        if (m_Fusion && m_Fusion->IsReadyToFuse())
+            m_BlockCache.SetFusion(m_Fusion->SelectPatterns());
+
+        // addresses wrap at 4K
+        m_ProgramCounter &= 0x0FFF;
+
+        const Block& block = m_BlockCache.Lookup(m_ProgramCounter, m_GameMemory, sizeof(m_GameMemory));
+        int length = block.length < count ? block.length : count;
+        bool profiling = m_Fusion && m_Fusion->IsProfiling();
+
+        int i = 0;
+        int skipped = 0;
+        while (i < length)
+        {
+            const Instruction& ins = block.ops[i];
+            int width = GetInstructionWidth(ins.handler);
+            if (i + width > length)
+                break;
+
+            if (profiling)
+                m_Fusion->Count(ins.handler);
+            PROFILE_INSTRUCTION(m_ProgramCounter, ins.handler);
+
+            WORD next = m_ProgramCounter + 2 * width;
+            m_ProgramCounter = next;
+            (this->*m_Handlers[ins.handler])(ins);
+            i += width;
+
+            // a loop that exited through its skip never ran the jump
+            if (m_ProgramCounter == next && IsFusedLoop(ins.handler))
+                skipped = 1;
+        }
+
+        // a superinstruction that does not fit in the budget runs one opcode at a time
+        for (; i < length; i++)
+        {
+            const Instruction& ins = s_DecodeTable[GetNextOpcode()];
+            PROFILE_INSTRUCTION(m_ProgramCounter - 2, ins.handler);
+            (this->*m_Handlers[ins.handler])(ins);
+        }
+
+        count -= length - skipped;
+    }
+}
+
+#endif
+
+// The timers only change on a tick, so the count is run in slices that
+// end where one falls, and each slice sees the timers at one value
+void Chip8::ExecuteOpcodes(int count)
+{
+    while (count > 0)
+    {
+        int slice = BeginSlice(count);
+        RunSlice(slice);
+        count -= slice;
+    }
+}
+
+// Counts the next count instructions, or those up to the next tick if
+// that is sooner, as run and returns how many that is
+int Chip8::BeginSlice(int count)
+{
+    m_Tick = GetTimerTicks(m_InstructionCount + 1, m_OpcodesPerSecond);
+    uint64_t next = m_Tick * m_OpcodesPerSecond / TIMER_HZ;
+    if (next - m_InstructionCount < (uint64_t)count)
+        count = (int)(next - m_InstructionCount);
+    m_InstructionCount += count;
+    return count;
+}
+
+// Runs count instructions, or as many as it takes to find the machine
+// waiting for the next tick or key and the rest are skipped
+void Chip8::RunSlice(int count)
+{
+    if (m_IdleSkip)
+    {
+        // a delay timer loop caught part way through finishes its pass first
+        int lead = GetIdleLead();
+        if (lead > 0 && lead < count)
+        {
+            RunOpcodes(lead);
+            count -= lead;
+            lead = GetIdleLead();
+        }
+        if (0 == lead)
+        {
+            SkipIdle(count);
+            return;
+        }
+    }
+    RunOpcodes(count);
+}
+
+// Runs count instructions on the JIT when it is enabled, else on the interpreter
+void Chip8::RunOpcodes(int count)
+{
+    if (m_Jit)
+        m_Jit->Execute(*this, count);
+    else
+        InterpretOpcodes(count);
+}
+
+static WORD ReadOpcode(const BYTE* memory, int address)
+{
+    return memory[address & 0x0FFF] << 8 | memory[(address + 1) & 0x0FFF];
+}
+
+// Nothing but the timers and keys can get the machine out of these waits,
+// and they only change on a tick or between calls. Returns 0 in such a
+// wait, 1 or 2 for the instructions left to the start of a delay timer
+// loop, which is only a wait once the timer has been read this tick, and
+// -1 otherwise
+int Chip8::GetIdleLead()
+{
+    WORD pc = m_ProgramCounter & 0x0FFF;
+    WORD opcode = ReadOpcode(m_GameMemory, pc);
+
+    // a jump to itself
+    if ((0x1000 | pc) == opcode)
+        return 0;
+
+    // FX0A stays put until a key is down
+    if (0xF00A == (opcode & 0xF0FF))
+        return -1 == GetKeyPressed() ? 0 : -1;
+
+    // FX07, 3XNN, 1NNN back to the FX07, until the timer reaches NN
+    for (int phase = 0; phase < 3; phase++)
     {
-        for(int y=0;y<320;y++)
+        WORD start = (pc - 2 * phase) & 0x0FFF;
+        WORD read = ReadOpcode(m_GameMemory, start);
+        WORD test = ReadOpcode(m_GameMemory, start + 2);
+        if (0xF007 == (read & 0xF0FF) && (0x3000 | (read & 0x0F00)) == (test & 0xFF00) &&
+            (0x1000 | start) == ReadOpcode(m_GameMemory, start + 4))
         {
-            m_ScreenData[y][x][0] = 255;
-            m_ScreenData[y][x][1] = 255;
-            m_ScreenData[y][x][2] = 255;
+            if (phase)
+                return 3 - phase;
+            return GetTimerValue(m_DelayExpiry, m_Tick) != (test & 0xFF) ? 0 : -1;
         }
     }
+    return -1;
+}
+
+// Leaves the machine as running count more instructions of the wait would
+void Chip8::SkipIdle(int count)
+{
+    m_IdleSkipped += count;
+
+    // each pass of a delay timer loop reads the timer, and count decides
+    // where in the loop the slice ends
+    WORD pc = m_ProgramCounter & 0x0FFF;
+    WORD opcode = ReadOpcode(m_GameMemory, pc);
+    if (0xF007 == (opcode & 0xF0FF))
+    {
+        m_Registers[(opcode >> 8) & 0xF] = GetTimerValue(m_DelayExpiry, m_Tick);
+        m_ProgramCounter = (pc + 2 * (count % 3)) & 0x0FFF;
+    }
+}
+
+void Chip8::EnableIdleSkip(bool enable)
+{
+    m_IdleSkip = enable;
+}
+
+long long Chip8::GetIdleSkipCount() const
+{
+    return (long long)m_IdleSkipped;
+}
+
+bool Chip8::EnableJit(bool enable)
+{
+    if (!enable)
+    {
+        m_Jit.reset();
+        return true;
+    }
+
+    // translated code would run past the profiling counters
+#if defined(CHIP8_PROFILE)
+    return false;
+#endif
+    if (!Jit::IsSupported())
+        return false;
+
+    if (!m_Jit)
+        m_Jit.reset(new Jit(*this));
+
+    // the JIT translates plain blocks only
+    m_Fusion.reset();
+    m_BlockCache.SetFusion(0);
+
+    return m_Jit->IsReady();
+}
+
+bool Chip8::IsJitEnabled() const
+{
+    return m_Jit != 0;
+}
+
+// Profiles adjacent opcode pairs for profileInstructions instructions, then
+// has the block cache fuse the hot ones into superinstructions.
+// Only the BLOCK dispatch engine without the JIT runs superinstructions.
+bool Chip8::EnableFusion(long long profileInstructions)
+{
+#if defined(CHIP8_DISPATCH_BLOCK)
+    if (m_Jit)
+        return false;
+
+    m_Fusion.reset(new FusionProfile(profileInstructions));
+    m_BlockCache.SetFusion(0);
+    return true;
+#else
+    (void)profileInstructions;
+    return false;
+#endif
+}
+
+const ExecutionProfile* Chip8::GetExecutionProfile() const
+{
+    return m_Profile.get();
+}
+
+const FusionProfile* Chip8::GetFusionProfile() const
+{
+    return m_Fusion.get();
+}
+
+// Runs a single decoded instruction, used by the JIT to exit to C++
+void Chip8::ExecuteInstruction(const Instruction& ins)
+{
+    (this->*m_Handlers[ins.handler])(ins);
+}
+
+// Unknown opcodes are ignored
+void Chip8::OpcodeNone(const Instruction&)
+{
+}
+
+// Superinstructions. Each runs the instructions that follow it in the block
+// with the program counter each of them would have seen on its own.
+
+// Two register loads
+void Chip8::Opcode6XNN_6XNN(const Instruction& ins)
+{
+    Opcode6XNN(ins);
+    Opcode6XNN((&ins)[1]);
+}
+
+// Two register adds
+void Chip8::Opcode7XNN_7XNN(const Instruction& ins)
+{
+    Opcode7XNN(ins);
+    Opcode7XNN((&ins)[1]);
+}
+
+// Point I at a sprite and draw it
+template <class Quirks>
+void Chip8::OpcodeANNN_DXYN(const Instruction& ins)
+{
+    OpcodeANNN(ins);
+    OpcodeDXYN<Quirks>((&ins)[1]);
+}
+
+// Counter loop: add, test, jump back unless the test skipped the jump
+void Chip8::Opcode7XNN_3XNN_1NNN(const Instruction& ins)
+{
+    WORD jump = m_ProgramCounter - 2;
+    m_ProgramCounter = jump;
+
+    Opcode7XNN(ins);
+    Opcode3XNN((&ins)[1]);
+    if (m_ProgramCounter == jump)
+    {
+        m_ProgramCounter += 2;
+        Opcode1NNN((&ins)[2]);
+    }
+}
+
+// Delay timer wait: read the timer, test, jump back unless the test skipped the jump
+void Chip8::OpcodeFX07_3XNN_1NNN(const Instruction& ins)
+{
+    WORD jump = m_ProgramCounter - 2;
+    m_ProgramCounter = jump;
+
+    OpcodeFX07(ins);
+    Opcode3XNN((&ins)[1]);
+    if (m_ProgramCounter == jump)
+    {
+        m_ProgramCounter += 2;
+        Opcode1NNN((&ins)[2]);
+    }
+}
+
+// Clear the screen
+void Chip8::Opcode00E0(const Instruction&)
+{
+    // a screen that is already clear stays clean
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        if (m_Display[y])
+            m_DirtyRows |= 1u << y ;
+    }
+    memset(m_Display,0,sizeof(m_Display)) ;
 }
 
 // Returns from subroutine
-void Chip8::Opcode00EE	()
+void Chip8::Opcode00EE(const Instruction&)
 {
-    m_ProgramCounter = m_Stack.back();
-    m_Stack.pop_back();
+    m_StackPointer = (m_StackPointer - 1) & 0xF;
+    m_ProgramCounter = m_Stack[m_StackPointer];
 }
 
 // Jump to address at NNN
-void Chip8::Opcode1NNN(WORD opcode)
+void Chip8::Opcode1NNN(const Instruction& ins)
 {
-    m_ProgramCounter = opcode & 0x0FFF; // only interested in NNN of opcode 1NNN
+    m_ProgramCounter = ins.nnn;
 }
 
 // Calls subroutine at NNN
-void Chip8::Opcode2NNN(WORD opcode)
+void Chip8::Opcode2NNN(const Instruction& ins)
 {
-    m_Stack.push_back(m_ProgramCounter);
-    m_ProgramCounter = opcode & 0x0FFF;
+    m_Stack[m_StackPointer] = m_ProgramCounter;
+    m_StackPointer = (m_StackPointer + 1) & 0xF;
+    m_ProgramCounter = ins.nnn;
 }
 
-// Skip instruction if Vx == NN 
-void Chip8::Opcode3XNN(WORD opcode)
+// Skip instruction if Vx == NN
+void Chip8::Opcode3XNN(const Instruction& ins)
 {
-    if(m_Registers[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF))
+    if(m_Registers[ins.x] == ins.nn)
     {
         m_ProgramCounter += 2;
     }
 }
 
 // Skip instruction if Vx != NN
-void Chip8::Opcode4XNN(WORD opcode)
+void Chip8::Opcode4XNN(const Instruction& ins)
 {
-    if(m_Registers[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF))
+    if(m_Registers[ins.x] != ins.nn)
     {
         m_ProgramCounter += 2;
     }
 }
 
 // Skip instruction if Vx == Vy
-void Chip8::Opcode5XY0(WORD opcode)
+void Chip8::Opcode5XY0(const Instruction& ins)
 {
-    if(m_Registers[(opcode & 0x0F00) >> 8] == m_Registers[(opcode & 0x00F0) >> 4])
+    if(m_Registers[ins.x] == m_Registers[ins.y])
     {
         m_ProgramCounter += 2;
     }
 }
 
 // Set Vx as NN
-void Chip8::Opcode6XNN(WORD opcode)
+void Chip8::Opcode6XNN(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] = (opcode & 0x00FF);
+    m_Registers[ins.x] = ins.nn;
 }
 
 // Adds NN to Vx
-void Chip8::Opcode7XNN(WORD opcode)
+void Chip8::Opcode7XNN(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] += (opcode & 0x00FF);
+    m_Registers[ins.x] += ins.nn;
 }
 
 // Set Vx as Vy
-void Chip8::Opcode8XY0(WORD opcode)
+void Chip8::Opcode8XY0(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] = m_Registers[(opcode & 0x00F0) >>4];
+    m_Registers[ins.x] = m_Registers[ins.y];
 }
 
 // Apply Vx OR Vy to Vx
-void Chip8::Opcode8XY1(WORD opcode)
+void Chip8::Opcode8XY1(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] |= m_Registers[(opcode & 0x00F0) >>4];
+    m_Registers[ins.x] |= m_Registers[ins.y];
 }
 
 // Apply Vx AND Vy to Vx
-void Chip8::Opcode8XY2(WORD opcode)
+void Chip8::Opcode8XY2(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] &= m_Registers[(opcode & 0x00F0) >>4];
+    m_Registers[ins.x] &= m_Registers[ins.y];
 }
 
 // Apply Vx XOR Vy to Vx
-void Chip8::Opcode8XY3(WORD opcode)
+void Chip8::Opcode8XY3(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] ^= m_Registers[(opcode & 0x00F0) >>4];
+    m_Registers[ins.x] ^= m_Registers[ins.y];
 }
 
 // Apply Vx +=Vy
 // Vf is overflow flag
-void Chip8::Opcode8XY4(WORD opcode)
+void Chip8::Opcode8XY4(const Instruction& ins)
 {
     m_Registers[0xF] = 0;
-    int val = m_Registers[(opcode & 0x0F00) >>8] + m_Registers[(opcode & 0x00F0) >> 4];
+    int val = m_Registers[ins.x] + m_Registers[ins.y];
     if(val > 255)
         m_Registers[0xF] = 1;
 
-    m_Registers[(opcode & 0x0F00) >>8] += m_Registers[(opcode & 0x00F0) >> 4];
+    m_Registers[ins.x] += m_Registers[ins.y];
 }
 
 // Apply Vx -=Vy
 // Vf is 0 when underflow
-void Chip8::Opcode8XY5(WORD opcode)
+void Chip8::Opcode8XY5(const Instruction& ins)
 {
     m_Registers[0xF] = 1;
-    if(m_Registers[(opcode & 0x0F00) >>8] < m_Registers[(opcode & 0x00F0) >> 4])
+    if(m_Registers[ins.x] < m_Registers[ins.y])
         m_Registers[0xF] = 0;
-    
-    m_Registers[(opcode & 0x0F00) >>8] -= m_Registers[(opcode & 0x00F0) >> 4];
+
+    m_Registers[ins.x] -= m_Registers[ins.y];
 }
 
-// Apply >> 1
+// Apply >> 1, to Vy on the COSMAC VIP
 // Vf contains lost bit
-void Chip8::Opcode8XY6(WORD opcode)
+template <class Quirks>
+void Chip8::Opcode8XY6(const Instruction& ins)
 {
-    m_Registers[0xF] = m_Registers[((opcode & 0x0F00)>>8)] & 0x1;
-    m_Registers[(opcode & 0x0F00)>>8] >>=1;
+    if (Quirks::SHIFT_READS_VY)
+        m_Registers[ins.x] = m_Registers[ins.y];
+    m_Registers[0xF] = m_Registers[ins.x] & 0x1;
+    m_Registers[ins.x] >>=1;
 }
 
 // Apply Vx = Vy-Vx
 // Vf is 0 when underflow
-void Chip8::Opcode8XY7(WORD opcode)
+void Chip8::Opcode8XY7(const Instruction& ins)
 {
     m_Registers[0xF] = 1;
-    if(m_Registers[(opcode & 0x00F0) >> 4] < m_Registers[(opcode & 0x0F00) >>8])
+    if(m_Registers[ins.y] < m_Registers[ins.x])
         m_Registers[0xF] = 0;
-    m_Registers[(opcode & 0x0F00) >>8] = m_Registers[(opcode & 0x00F0) >>4] - m_Registers[(opcode & 0x0F00) >>8];
+    m_Registers[ins.x] = m_Registers[ins.y] - m_Registers[ins.x];
 }
 
-// Apply << 1
+// Apply << 1, to Vy on the COSMAC VIP
 // Vf contains lost bit
-void Chip8::Opcode8XYE(WORD opcode)
+template <class Quirks>
+void Chip8::Opcode8XYE(const Instruction& ins)
 {
-    m_Registers[0xF] = m_Registers[((opcode & 0x0F00)>>8)] >> 7;
-    m_Registers[(opcode & 0x0F00)>>8] <<=1;
+    if (Quirks::SHIFT_READS_VY)
+        m_Registers[ins.x] = m_Registers[ins.y];
+    m_Registers[0xF] = m_Registers[ins.x] >> 7;
+    m_Registers[ins.x] <<=1;
 }
 
 // Skip instruction if Vx != Vy
-void Chip8::Opcode9XY0(WORD opcode)
+void Chip8::Opcode9XY0(const Instruction& ins)
 {
-    if(m_Registers[(opcode & 0x0F00) >> 8] != m_Registers[(opcode & 0x00F0) >> 4])
+    if(m_Registers[ins.x] != m_Registers[ins.y])
     {
         m_ProgramCounter += 2;
     }
 }
 
 // Set I to NNN
-void Chip8::OpcodeANNN(WORD opcode)
+void Chip8::OpcodeANNN(const Instruction& ins)
 {
-    m_AddressI = opcode & 0x0FFF;
+    m_AddressI = ins.nnn;
 }
 
-// Set PC to NNN + V0
-void Chip8::OpcodeBNNN(WORD opcode)
+// Set PC to NNN + V0, or to XNN + Vx on the SUPER-CHIP
+template <class Quirks>
+void Chip8::OpcodeBNNN(const Instruction& ins)
 {
-    m_ProgramCounter = (opcode & 0x0FFF) + m_Registers[0];
+    m_ProgramCounter = ins.nnn + m_Registers[Quirks::JUMP_ADDS_VX ? ins.x : 0];
 }
 
-// Set Vx to rand & NN
-void Chip8::OpcodeCXNN(WORD opcode)
+// Set Vx to a random byte & NN
+void Chip8::OpcodeCXNN(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] = (rand() % 255) & (opcode & 0x00FF);
+    m_Registers[ins.x] = NextRandom(m_RandomState) & ins.nn;
 }
 
-// Draw sprite at Vx,Vy
-// Vf is 1 if any screen pixels are flipped from set to unset
-void Chip8::OpcodeDXYN(WORD opcode)
+// XORs sprite rows into consecutive display rows and returns the pixels
+// that were already set
+static inline uint64_t XorRows(uint64_t* rows, const uint64_t* bits, int count)
 {
-    const int SCALE = 10 ;
-	int regx = (opcode & 0x0F00) >> 8 ;
-	int regy = (opcode & 0x00F0) >> 4 ;
-
-	int coordx = m_Registers[regx] * SCALE;
-	int coordy = m_Registers[regy] * SCALE ;
-	int height = opcode & 0x000F ;
-
-	m_Registers[0xf] = 0 ;
+	uint64_t collision = 0 ;
+	int i = 0 ;
+#if defined(__SSE2__)
+	__m128i pairs = _mm_setzero_si128() ;
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i row = _mm_loadu_si128((const __m128i*)(rows + i)) ;
+		__m128i sprite = _mm_loadu_si128((const __m128i*)(bits + i)) ;
+		pairs = _mm_or_si128(pairs, _mm_and_si128(row, sprite)) ;
+		_mm_storeu_si128((__m128i*)(rows + i), _mm_xor_si128(row, sprite)) ;
+	}
+	uint64_t halves[2] ;
+	_mm_storeu_si128((__m128i*)halves, pairs) ;
+	collision = halves[0] | halves[1] ;
+#endif
+	for (; i < count; i++)
+	{
+		collision |= rows[i] & bits[i] ;
+		rows[i] ^= bits[i] ;
+	}
+	return collision ;
+}
 
+// Draw sprite at Vx,Vy, wrapping or clipping at the edges
+// Vf is 1 if any screen pixels are flipped from set to unset
+template <class Quirks>
+void Chip8::OpcodeDXYN(const Instruction& ins)
+{
+	int coordx = m_Registers[ins.x] % DISPLAY_WIDTH ;
+	int coordy = m_Registers[ins.y] % DISPLAY_HEIGHT ;
+	int height = ins.n ;
+	if (Quirks::CLIP_SPRITES && coordy + height > DISPLAY_HEIGHT)
+		height = DISPLAY_HEIGHT - coordy ;
+
+	// each line of the sprite at m_AddressI shifted into place as a whole
+	// display row. Any row it sets a pixel in changes
+	uint64_t bits[16] ;
 	for (int yline = 0; yline < height; yline++)
 	{
-		// this is the data of the sprite stored at m_GameMemory[m_AddressI]
-		// the data is stored as a line of bytes so each line is indexed by m_AddressI + yline
-		BYTE data = (m_GameMemory[m_AddressI+yline]);
-
-		// for each of the 8 pixels in the line
-		int xpixel = 0 ;
-		int xpixelinv = 7 ;
-		for(xpixel = 0; xpixel < 8; xpixel++, xpixelinv--)
-		{
-			
-			// is ths pixel set to 1? If so then the code needs to toggle its state
-			int mask = 1 << xpixelinv ;
-			if (data & mask)
-			{
-				int x = (xpixel*SCALE) + coordx ;
-				int y = coordy + (yline*SCALE) ;
-
-				int colour = 0 ;
-
-				// a collision has been detected
-				if (m_ScreenData[y][x][0] == 0)
-				{
-					colour = 255 ;
-					m_Registers[0xf]=1;
-				}
-
-				// colour the pixel
-				for (int i = 0; i < SCALE; i++)
-				{
-					for (int j = 0; j < SCALE; j++)
-					{
-						m_ScreenData[y+i][x+j][0] = colour ;
-						m_ScreenData[y+i][x+j][1] = colour ;
-						m_ScreenData[y+i][x+j][2] = colour ;
-					}
-				}
-
-			}
-		}
+		bits[yline] = SpriteRow<Quirks>(m_GameMemory[(m_AddressI + yline) & 0x0FFF], coordx) ;
+		m_DirtyRows |= (uint32_t)(0 != bits[yline]) << ((coordy + yline) % DISPLAY_HEIGHT) ;
 	}
+	PROFILE_READS(m_AddressI, height);
+
+	// the rows down to the bottom edge, then any wrapped round to the top
+	int below = DISPLAY_HEIGHT - coordy < height ? DISPLAY_HEIGHT - coordy : height ;
+	uint64_t collision = XorRows(m_Display + coordy, bits, below) ;
+	collision |= XorRows(m_Display, bits + below, height - below) ;
+
+	// a collision has been detected
+	m_Registers[0xf] = 0 != collision ;
 }
 
 // Skip instruction if key in Vx is pressed
-void Chip8::OpcodeEX9E(WORD opcode)
+void Chip8::OpcodeEX9E(const Instruction& ins)
 {
-    if(m_KeyState[m_Registers[(opcode & 0x0F00) >> 8]] == 1)
+    if(m_KeyState[m_Registers[ins.x]] == 1)
     {
         m_ProgramCounter += 2;
     }
 }
 
 // Skip instruction if key in Vx is not pressed
-void Chip8::OpcodeEXA1(WORD opcode)
+void Chip8::OpcodeEXA1(const Instruction& ins)
 {
-    if(m_KeyState[m_Registers[(opcode & 0x0F00) >> 8]] != 1)
+    if(m_KeyState[m_Registers[ins.x]] != 1)
     {
         m_ProgramCounter += 2;
     }
 }
 
 // Set Vx to delay timer
-void Chip8::OpcodeFX07(WORD opcode)
+void Chip8::OpcodeFX07(const Instruction& ins)
 {
-    m_Registers[(opcode & 0x0F00) >> 8] = m_DelayTimer;
+    m_Registers[ins.x] = GetTimerValue(m_DelayExpiry, m_Tick);
 }
 
 // key press is stored in Vx
-void Chip8::OpcodeFX0A(WORD opcode)
+void Chip8::OpcodeFX0A(const Instruction& ins)
 {
-    int regx = (opcode & 0x0F00) >> 8 ;
 	int keypressed = GetKeyPressed( ) ;
 
 	if (keypressed == -1)
@@ -455,63 +1417,78 @@ void Chip8::OpcodeFX0A(WORD opcode)
 	}
 	else
 	{
-		m_Registers[regx] = keypressed ;
+		m_Registers[ins.x] = keypressed ;
 	}
 }
 
 // Set delay timer to Vx
-void Chip8::OpcodeFX15(WORD opcode)
+void Chip8::OpcodeFX15(const Instruction& ins)
 {
-    m_DelayTimer = m_Registers[(opcode & 0x0F00) >> 8];
+    m_DelayExpiry = m_Tick + m_Registers[ins.x];
 }
 
 // Set sound timer to Vx
-void Chip8::OpcodeFX18(WORD opcode)
+void Chip8::OpcodeFX18(const Instruction& ins)
 {
-    m_SoundTimer = m_Registers[(opcode & 0x0F00) >> 8];
+    m_SoundExpiry = m_Tick + m_Registers[ins.x];
 }
 
 // I += Vx
-void Chip8::OpcodeFX1E(WORD opcode)
+void Chip8::OpcodeFX1E(const Instruction& ins)
 {
-    m_AddressI += m_Registers[(opcode & 0x0F00) >> 8];
+    m_AddressI += m_Registers[ins.x];
 }
 
 // Set I to location of sprite in Vx
-void Chip8::OpcodeFX29(WORD opcode)
+void Chip8::OpcodeFX29(const Instruction& ins)
 {
-    m_AddressI = m_Registers[(opcode & 0x0F00) >> 8] * 5;
+    m_AddressI = m_Registers[ins.x] * 5;
 }
 
 // Stores binary coded decimal rep of Vx
-void Chip8::OpcodeFX33(WORD opcode)
+void Chip8::OpcodeFX33(const Instruction& ins)
 {
-    int value = m_Registers[(opcode & 0x0F00) >> 8];
+    int value = m_Registers[ins.x];
     int hundreds = value / 100;
     int tens = (value / 10) % 10;
     int units = value % 10;
 
+    // the old bytes leave the memory hash and the new ones join it
+    m_MemoryHash ^= HashMemoryWords(m_AddressI, 3);
     m_GameMemory[m_AddressI] = hundreds;
     m_GameMemory[m_AddressI+1] = tens;
     m_GameMemory[m_AddressI+2] = units;
+    m_MemoryHash ^= HashMemoryWords(m_AddressI, 3);
+    PROFILE_WRITES(m_AddressI, 3);
+
+    m_BlockCache.Invalidate(m_AddressI, 3);
 }
 
 // Stores V0 -> Vx in memory starting at I
-void Chip8::OpcodeFX55(WORD opcode)
+template <class Quirks>
+void Chip8::OpcodeFX55(const Instruction& ins)
 {
-    for(int i=0; i<= (opcode & 0x0F00) >> 8; i++)
+    m_MemoryHash ^= HashMemoryWords(m_AddressI, ins.x + 1);
+    for(int i=0; i<= ins.x; i++)
     {
         m_GameMemory[m_AddressI+i] = m_Registers[i];
     }
-    m_AddressI = m_AddressI+ ((opcode & 0x0F00) >>8 )+1;
+    m_MemoryHash ^= HashMemoryWords(m_AddressI, ins.x + 1);
+    PROFILE_WRITES(m_AddressI, ins.x + 1);
+    m_BlockCache.Invalidate(m_AddressI, ins.x + 1);
+    if (Quirks::LOAD_STORE_ADVANCES_I)
+        m_AddressI = m_AddressI+ ins.x +1;
 }
 
 // Fills V0->Vx from memory starting at I
-void Chip8::OpcodeFX65(WORD opcode)
+template <class Quirks>
+void Chip8::OpcodeFX65(const Instruction& ins)
 {
-    for(int i=0; i<= (opcode & 0x0F00) >> 8; i++)
+    for(int i=0; i<= ins.x; i++)
     {
-        m_Registers[m_AddressI+i] = m_GameMemory[i];
+        m_Registers[i] = m_GameMemory[m_AddressI+i];
     }
-    m_AddressI = m_AddressI+ ((opcode & 0x0F00) >>8) +1;
-}
\ No newline at end of file
+    PROFILE_READS(m_AddressI, ins.x + 1);
+    if (Quirks::LOAD_STORE_ADVANCES_I)
+        m_AddressI = m_AddressI+ ins.x +1;
+}
@@ -1,87 +1,244 @@
 #pragma once
+#include <stdint.h>
+#include <memory>
 #include <string>
-#include <vector>
 
-
-typedef unsigned char BYTE; 
-typedef unsigned short int WORD;
+#include "instruction.h"
+#include "blockcache.h"
+#include "quirks.h"
+#include "random.h"
 
 const int ROMSIZE = 0xFFF ;
+const int DISPLAY_WIDTH = 64 ;
+const int DISPLAY_HEIGHT = 32 ;
+// one bit per display row, bit y for row y
+const uint32_t ALL_DISPLAY_ROWS = 0xFFFFFFFF ;
+// the delay and sound timers count down at this rate of emulated time
+const int TIMER_HZ = 60 ;
+const int DEFAULT_OPCODES_PER_SECOND = 700 ;
+
+// One sprite row as display bits, wrapping or clipping at the right edge
+template <class Quirks>
+inline uint64_t SpriteRow(BYTE data, int coordx)
+{
+    uint64_t bits = (uint64_t)data << (DISPLAY_WIDTH - 8);
+    if (Quirks::CLIP_SPRITES || 0 == coordx)
+        return bits >> coordx;
+    return (bits >> coordx) | (bits << (DISPLAY_WIDTH - coordx));
+}
+
+class ExecutionProfile;
+class FusionProfile;
+class Jit;
+
+// Everything a running machine needs to resume, as plain bytes so states
+// can be diffed and compressed. Key state and settings such as the quirk
+// profile belong to the session, not the snapshot.
+struct Chip8State
+{
+    uint64_t display[DISPLAY_HEIGHT] ;
+    uint64_t instructionCount ;
+    uint64_t randomState ; // CXNN's generator
+    WORD stack[16] ;      // return addresses
+    WORD addressI ;
+    WORD programCounter ;
+    BYTE registers[16] ;
+    BYTE stackPointer ;   // next free slot in stack, wraps at 16
+    BYTE delayTimer ;
+    BYTE soundTimer ;
+    BYTE memory[0x1000] ;
+};
 
 class Chip8
 {
 public:
+    Chip8();
     ~Chip8();
 
-    static Chip8* CreateSingleton( ) ;
+    // each machine is independent, so any number can run side by side
+    Chip8(Chip8&& other);
+    Chip8& operator=(Chip8&& other);
+    Chip8(const Chip8&) = delete;
+    Chip8& operator=(const Chip8&) = delete;
+
+    // Forking for search over inputs. Clone gives a new machine with no
+    // decoded blocks, CopyStateFrom reuses this machine's caches and only
+    // drops the blocks over memory that differs.
+    Chip8 Clone() const;
+    void CopyStateFrom(const Chip8& other);
+    // everything that decides what the machine does next, to find duplicate
+    // states. Held keys are not part of it, set them before running on
+    uint64_t GetStateHash() const;
 
-    bool LoadRom(const std::string& romname) ;
+    bool LoadRom(const std::string& romname, QuirkProfile quirks = QUIRKS_DEFAULT) ;
     void ExecuteNextOpcode();
-    void DecreaseTimers( );
+    void ExecuteOpcodes(int count);
+    bool EnableJit(bool enable);
+    bool IsJitEnabled() const;
+    bool EnableFusion(long long profileInstructions);
+    // ExecuteOpcodes skips what is left of its count once the machine can
+    // only wait for the next tick or key: in a delay timer loop, a jump to
+    // itself or FX0A with no key down. The machine ends up as it would
+    // have running them, so this is on unless turned off
+    void EnableIdleSkip(bool enable);
+    // instructions skipped since the rom was loaded
+    long long GetIdleSkipCount() const;
+    // The timers tick at TIMER_HZ of emulated time, worked out from the
+    // instruction count at this rate, so they do not depend on how a run is
+    // split into frames. Kept across LoadRom; the timers keep their values
+    void SetOpcodesPerSecond(int opcodesPerSecond);
+    int GetOpcodesPerSecond() const;
+    // ticks before the instruction at instructionCount runs
+    static uint64_t GetTimerTicks(uint64_t instructionCount, int opcodesPerSecond);
+    const FusionProfile* GetFusionProfile() const;
+    // execution counts since the rom was loaded, 0 unless built with -DCHIP8_PROFILE
+    const ExecutionProfile* GetExecutionProfile() const;
     void KeyPressed( int key );
     void KeyReleased( int key );
+    bool IsKeyPressed(int key) const;
     WORD GetProgramCounter();
+    WORD GetAddressI() const;
+    const BYTE* GetRegisters() const;
+    BYTE GetDelayTimer() const;
+    BYTE GetSoundTimer() const;
+    const uint64_t* GetDisplay() const;
+    uint64_t GetDisplayHash() const;
+    // Rows changed since the last TakeDirtyRows, so a frontend can skip
+    // frames where nothing was drawn and upload only the rows that were
+    bool IsDisplayDirty() const;
+    uint32_t TakeDirtyRows();
+    static uint64_t HashDisplay(const uint64_t* display);
+    long long GetInstructionCount() const;
+    QuirkProfile GetQuirkProfile() const;
+    void SetQuirkProfile(QuirkProfile quirks);
+    // seeds CXNN, kept across LoadRom; restarts the sequence
+    void SetRandomSeed(uint64_t seed);
+    uint64_t GetRandomSeed() const;
+    void SaveState(Chip8State& state) const;
+    void LoadState(const Chip8State& state);
+
+    static const char* GetDispatchEngine();
+    static const char* GetOpcodeName(BYTE handler);
+    static Instruction DecodeInstruction(WORD opcode);
+    static const char* GetQuirkProfileName(QuirkProfile quirks);
+    static bool ParseQuirkProfile(const char* name, QuirkProfile& quirks);
 private:
-    Chip8();
+    friend class Jit;
+    friend class AotRuntime;
+    friend class LockstepMachines;
+    typedef void (Chip8::*OpcodeHandler)(const Instruction& ins);
 
     void CPUReset();
+    void CopyState(const Chip8& other);
+    void CopyRegisters(const Chip8& other);
+    uint64_t HashMemoryWords(int address, int length) const;
+    void RehashMemory();
     WORD GetNextOpcode();
-    void PlaySound();
+    void InterpretOpcodes(int count);
+    int BeginSlice(int count);
+    void RunSlice(int count);
+    void RunOpcodes(int count);
+    int GetIdleLead();
+    void SkipIdle(int count);
+    template <class Quirks> void ExecuteNextOpcodeWith();
+    template <class Quirks> void InterpretOpcodesWith(int count);
+    void ExecuteInstruction(const Instruction& ins);
     int GetKeyPressed();
     
-    void Opcode00EE	();
-    void Opcode00E0 ();
-    void Opcode1NNN	( WORD opcode ) ;
-    void Opcode2NNN	( WORD opcode ) ;
-    void Opcode3XNN	( WORD opcode ) ;
-    void Opcode4XNN	( WORD opcode ) ;
-    void Opcode5XY0	( WORD opcode ) ;
-    void Opcode6XNN	( WORD opcode ) ;
-    void Opcode7XNN	( WORD opcode ) ;
-    void Opcode8XY0	( WORD opcode ) ;
-    void Opcode8XY1	( WORD opcode ) ;
-    void Opcode8XY2	( WORD opcode ) ;
-    void Opcode8XY3	( WORD opcode ) ;
-    void Opcode8XY4	( WORD opcode ) ;
-    void Opcode8XY5	( WORD opcode ) ;
-    void Opcode8XY6	( WORD opcode ) ;
-    void Opcode8XY7	( WORD opcode ) ;
-    void Opcode8XYE	( WORD opcode ) ;
-    void Opcode9XY0	( WORD opcode ) ;
-    void OpcodeANNN	( WORD opcode ) ;
-    void OpcodeBNNN	( WORD opcode ) ;
-    void OpcodeCXNN	( WORD opcode ) ;
-    void OpcodeDXYN	( WORD opcode ) ;
-    void OpcodeEX9E	( WORD opcode ) ;
-    void OpcodeEXA1	( WORD opcode ) ;
-    void OpcodeFX07	( WORD opcode ) ;
-    void OpcodeFX0A	( WORD opcode ) ;
-    void OpcodeFX15	( WORD opcode ) ;
-    void OpcodeFX18	( WORD opcode ) ;
-    void OpcodeFX1E	( WORD opcode ) ;
-    void OpcodeFX29	( WORD opcode ) ;
-    void OpcodeFX33	( WORD opcode ) ;
-    void OpcodeFX55	( WORD opcode ) ;
-    void OpcodeFX65	( WORD opcode ) ;
-
-    void DecodeOpcode00(WORD opcode);
-    void DecodeOpcode8(WORD opcode);
-    void DecodeOpcodeE(WORD opcode);
-    void DecodeOpcodeF(WORD opcode);
-    
-public:
-    BYTE m_ScreenData[320][640][3]; 
+    void OpcodeNone ( const Instruction& ins ) ;
+    void Opcode00E0 ( const Instruction& ins ) ;
+    void Opcode00EE ( const Instruction& ins ) ;
+    void Opcode1NNN ( const Instruction& ins ) ;
+    void Opcode2NNN ( const Instruction& ins ) ;
+    void Opcode3XNN ( const Instruction& ins ) ;
+    void Opcode4XNN ( const Instruction& ins ) ;
+    void Opcode5XY0 ( const Instruction& ins ) ;
+    void Opcode6XNN ( const Instruction& ins ) ;
+    void Opcode7XNN ( const Instruction& ins ) ;
+    void Opcode8XY0 ( const Instruction& ins ) ;
+    void Opcode8XY1 ( const Instruction& ins ) ;
+    void Opcode8XY2 ( const Instruction& ins ) ;
+    void Opcode8XY3 ( const Instruction& ins ) ;
+    void Opcode8XY4 ( const Instruction& ins ) ;
+    void Opcode8XY5 ( const Instruction& ins ) ;
+    template <class Quirks> void Opcode8XY6 ( const Instruction& ins ) ;
+    void Opcode8XY7 ( const Instruction& ins ) ;
+    template <class Quirks> void Opcode8XYE ( const Instruction& ins ) ;
+    void Opcode9XY0 ( const Instruction& ins ) ;
+    void OpcodeANNN ( const Instruction& ins ) ;
+    template <class Quirks> void OpcodeBNNN ( const Instruction& ins ) ;
+    void OpcodeCXNN ( const Instruction& ins ) ;
+    template <class Quirks> void OpcodeDXYN ( const Instruction& ins ) ;
+    void OpcodeEX9E ( const Instruction& ins ) ;
+    void OpcodeEXA1 ( const Instruction& ins ) ;
+    void OpcodeFX07 ( const Instruction& ins ) ;
+    void OpcodeFX0A ( const Instruction& ins ) ;
+    void OpcodeFX15 ( const Instruction& ins ) ;
+    void OpcodeFX18 ( const Instruction& ins ) ;
+    void OpcodeFX1E ( const Instruction& ins ) ;
+    void OpcodeFX29 ( const Instruction& ins ) ;
+    void OpcodeFX33 ( const Instruction& ins ) ;
+    template <class Quirks> void OpcodeFX55 ( const Instruction& ins ) ;
+    template <class Quirks> void OpcodeFX65 ( const Instruction& ins ) ;
 
-private:
-    static Chip8* s_Instance;
+    void Opcode6XNN_6XNN ( const Instruction& ins ) ;
+    void Opcode7XNN_7XNN ( const Instruction& ins ) ;
+    template <class Quirks> void OpcodeANNN_DXYN ( const Instruction& ins ) ;
+    void Opcode7XNN_3XNN_1NNN ( const Instruction& ins ) ;
+    void OpcodeFX07_3XNN_1NNN ( const Instruction& ins ) ;
+
+    void DecodeOpcode00(const Instruction& ins);
+    template <class Quirks> void DecodeOpcode8(const Instruction& ins);
+    void DecodeOpcodeE(const Instruction& ins);
+    template <class Quirks> void DecodeOpcodeF(const Instruction& ins);
 
-    BYTE m_GameMemory[0xFFF] ; // 0xFFF bytes of memory
+    static bool BuildDecodeTable();
+
+    // opcode handlers indexed by OpcodeId, one table per quirk profile
+    template <class Quirks> struct HandlerTable
+    {
+        static const OpcodeHandler s_Handlers[OP_COUNT];
+    };
+    static const OpcodeHandler* const s_Handlers[QUIRK_PROFILE_COUNT];
+    static Instruction s_DecodeTable[0x10000];
+    static const bool s_DecodeTableBuilt;
+
+    BYTE m_GameMemory[0x1000] ; // 4K of memory
+    uint64_t m_MemoryHash ; // of m_GameMemory, updated on every store for GetStateHash
     BYTE m_Registers[16] ; // 16 registers, 1 byte each
     WORD m_AddressI ; // the 16-bit address register I
     WORD m_ProgramCounter ; // the 16-bit program counter
+    uint64_t m_InstructionCount ; // executed since the rom was loaded, stamps recorded input and times the timers
+    uint64_t m_RandomSeed ; // the generator restarts from this on every reset
+    uint64_t m_RandomState ; // CXNN's xorshift64* state, part of the snapshot
+
+    QuirkProfile m_Quirks ; // behaviour variant picked when the ROM was loaded
+    const OpcodeHandler* m_Handlers ; // handler table for m_Quirks
+    bool m_IdleSkip ; // session setting, see EnableIdleSkip
+    uint64_t m_IdleSkipped ; // instructions ExecuteOpcodes did not need to run
 
-    std::vector<WORD> m_Stack; // the 16-bit stack
+    WORD m_Stack[16] ; // return addresses, 16 deep like the original machine
+    BYTE m_StackPointer ; // next free slot, wraps at 16
     BYTE m_KeyState[16];
-    BYTE m_DelayTimer;
-    BYTE m_SoundTimer;
+    // the tick each timer reaches zero on, so they never need counting down
+    uint64_t m_DelayExpiry;
+    uint64_t m_SoundExpiry;
+    uint64_t m_Tick; // ticks seen by the instructions running now
+    int m_OpcodesPerSecond; // session setting, see SetOpcodesPerSecond
+
+    // one 64-bit word per display row, bit 63 is the leftmost pixel
+    uint64_t m_Display[DISPLAY_HEIGHT];
+    uint32_t m_DirtyRows; // set by 00E0, DXYN and anything replacing the display
+
+    // decoded blocks for the BLOCK dispatch engine and the JIT
+    BlockCache m_BlockCache;
+
+    // native code translator, only allocated while the JIT is enabled
+    std::unique_ptr<Jit> m_Jit;
+
+    // opcode pair counts and chosen superinstructions, only while fusion is enabled
+    std::unique_ptr<FusionProfile> m_Fusion;
+
+    // handler, address and memory counts, only allocated in CHIP8_PROFILE builds
+    std::unique_ptr<ExecutionProfile> m_Profile;
 };
\ No newline at end of file
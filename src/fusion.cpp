@@ -0,0 +1,132 @@
+#include "fusion.h"
+#include "chip8.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// a pattern is fused when each of its adjacent pairs made up at least
+// this share of the profiled instructions
+const double FUSION_THRESHOLD = 0.01 ;
+
+const FusionPattern g_FusionPatterns[] =
+{
+    // longest first so a triple wins over its leading pair
+    { OP_7XNN_3XNN_1NNN, 3, { OP_7XNN, OP_3XNN, OP_1NNN } }, // counter loop
+    { OP_FX07_3XNN_1NNN, 3, { OP_FX07, OP_3XNN, OP_1NNN } }, // delay timer wait
+    { OP_6XNN_6XNN,      2, { OP_6XNN, OP_6XNN } },
+    { OP_7XNN_7XNN,      2, { OP_7XNN, OP_7XNN } },
+    { OP_ANNN_DXYN,      2, { OP_ANNN, OP_DXYN } },
+};
+
+const int g_FusionPatternCount = sizeof(g_FusionPatterns) / sizeof(g_FusionPatterns[0]) ;
+
+int GetInstructionWidth(BYTE handler)
+{
+    switch (handler)
+    {
+        case OP_7XNN_3XNN_1NNN:
+        case OP_FX07_3XNN_1NNN:
+            return 3 ;
+        case OP_6XNN_6XNN:
+        case OP_7XNN_7XNN:
+        case OP_ANNN_DXYN:
+            return 2 ;
+        default:
+            return 1 ;
+    }
+}
+
+bool IsFusedLoop(BYTE handler)
+{
+    return handler == OP_7XNN_3XNN_1NNN || handler == OP_FX07_3XNN_1NNN ;
+}
+
+int MatchFusion(uint32_t enabled, const Instruction* ops, int available, WORD address)
+{
+    for (int p = 0; p < g_FusionPatternCount; p++)
+    {
+        const FusionPattern& pattern = g_FusionPatterns[p] ;
+        if (!(enabled & (1u << p)) || pattern.width > available)
+            continue ;
+
+        bool match = true ;
+        for (int i = 0; i < pattern.width && match; i++)
+            match = ops[i].handler == pattern.parts[i] ;
+
+        // loops must jump back to their own start
+        if (match && IsFusedLoop(pattern.fused))
+            match = ops[pattern.width - 1].nnn == address ;
+
+        if (match)
+            return p ;
+    }
+    return -1 ;
+}
+
+FusionProfile::FusionProfile(long long budget)
+    : m_Budget(budget)
+    , m_Remaining(budget)
+    , m_Previous(OP_NONE)
+    , m_Selected(false)
+    , m_Enabled(0)
+{
+    memset(m_Pairs,0,sizeof(m_Pairs)) ;
+}
+
+uint32_t FusionProfile::SelectPatterns()
+{
+    long long profiled = m_Budget - m_Remaining ;
+    double threshold = profiled * FUSION_THRESHOLD ;
+
+    m_Enabled = 0 ;
+    for (int p = 0; p < g_FusionPatternCount; p++)
+    {
+        const FusionPattern& pattern = g_FusionPatterns[p] ;
+        bool hot = true ;
+        for (int i = 0; i + 1 < pattern.width && hot; i++)
+            hot = m_Pairs[pattern.parts[i]][pattern.parts[i + 1]] > 0 &&
+                  m_Pairs[pattern.parts[i]][pattern.parts[i + 1]] >= threshold ;
+
+        if (hot)
+            m_Enabled |= 1u << p ;
+    }
+
+    m_Selected = true ;
+    return m_Enabled ;
+}
+
+// Prints the hottest pairs seen while profiling and the patterns that were fused
+void FusionProfile::PrintReport(FILE* out) const
+{
+    long long profiled = m_Budget - m_Remaining ;
+
+    std::vector<std::pair<uint32_t, int> > pairs ;
+    for (int a = 0; a < OP_COUNT; a++)
+        for (int b = 0; b < OP_COUNT; b++)
+            if (m_Pairs[a][b] > 0)
+                pairs.push_back(std::make_pair(m_Pairs[a][b], a * OP_COUNT + b)) ;
+
+    std::sort(pairs.rbegin(), pairs.rend()) ;
+
+    fprintf(out, "fusion profile: %lld instructions\n", profiled) ;
+    for (size_t i = 0; i < pairs.size() && i < 10; i++)
+    {
+        int a = pairs[i].second / OP_COUNT ;
+        int b = pairs[i].second % OP_COUNT ;
+        fprintf(out, "  %s %s  %6.2f%%\n", Chip8::GetOpcodeName(a), Chip8::GetOpcodeName(b),
+                profiled > 0 ? 100.0 * pairs[i].first / profiled : 0.0) ;
+    }
+
+    fprintf(out, "fused:") ;
+    bool any = false ;
+    for (int p = 0; p < g_FusionPatternCount; p++)
+    {
+        if (m_Enabled & (1u << p))
+        {
+            fprintf(out, " %s", Chip8::GetOpcodeName(g_FusionPatterns[p].fused)) ;
+            any = true ;
+        }
+    }
+    fprintf(out, "%s\n", any ? "" : " none") ;
+}
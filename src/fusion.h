@@ -0,0 +1,57 @@
+#pragma once
+#include "instruction.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+const int MAX_FUSION_WIDTH = 3 ;
+
+// A run of opcodes the block cache can replace with one superinstruction
+struct FusionPattern
+{
+    BYTE fused ;                     // OpcodeId of the superinstruction
+    BYTE width ;                     // number of instructions it replaces
+    BYTE parts[MAX_FUSION_WIDTH] ;   // OpcodeIds it replaces, in order
+};
+
+extern const FusionPattern g_FusionPatterns[] ;
+extern const int g_FusionPatternCount ;
+
+// Number of instructions an op in a block stands for
+int GetInstructionWidth(BYTE handler);
+
+// True for the loop superinstructions, which retire one opcode fewer
+// when their test skips the closing jump
+bool IsFusedLoop(BYTE handler);
+
+// Finds the first enabled pattern matching the ops decoded at address, -1 if none
+int MatchFusion(uint32_t enabled, const Instruction* ops, int available, WORD address);
+
+// Counts adjacent opcode pairs for a number of instructions, then picks
+// the superinstructions whose pairs turned out to be hot
+class FusionProfile
+{
+public:
+    explicit FusionProfile(long long budget);
+
+    void Count(BYTE handler)
+    {
+        m_Pairs[m_Previous][handler]++ ;
+        m_Previous = handler ;
+        m_Remaining-- ;
+    }
+
+    bool IsProfiling() const { return m_Remaining > 0 ; }
+    bool IsReadyToFuse() const { return m_Remaining <= 0 && !m_Selected ; }
+
+    uint32_t SelectPatterns();
+    void PrintReport(FILE* out) const;
+
+private:
+    long long m_Budget ;
+    long long m_Remaining ;
+    BYTE m_Previous ;
+    bool m_Selected ;
+    uint32_t m_Enabled ;
+    uint32_t m_Pairs[OP_COUNT][OP_COUNT] ;
+};
@@ -0,0 +1,376 @@
+#include "chip8.h"
+#include "fusion.h"
+#include "movie.h"
+#include "pacer.h"
+#include "profiler.h"
+#include "rewind.h"
+#include "savestate.h"
+#if defined(CHIP8_AOT)
+#include "aot.h"
+#endif
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+
+// Runs a ROM without a window as fast as the host allows and reports
+// throughput and the final machine state. With -R it runs in real time
+// instead, paced as the emulator is, and reports how close to the frame
+// deadlines it kept and how much CPU it took.
+//
+// Built with -DCHIP8_AOT and linked against a file from chip8-recompile it
+// runs that ROM's ahead-of-time translation instead of the interpreter.
+//
+// A savestate (.c8s) can be given in place of the ROM to resume from it,
+// or a movie (.c8m) to replay its recorded input at full speed.
+//
+// usage: chip8-headless <rom> [-f frames] [-n instructions] [-s opcodes-per-second] [-q quirks] [-S seed] [-w seconds] [-o savestate] [-P prefix] [-j] [-F] [-I] [-R] [-d]
+
+static void PrintUsage(const char* exe)
+{
+    printf("usage: %s <rom> [-f frames] [-n instructions] [-s opcodes-per-second] [-q quirks] [-S seed] [-w seconds] [-o savestate] [-P prefix] [-j] [-F] [-I] [-R] [-d]\n", exe);
+    printf("  -f  number of 60Hz frames to run (default 600)\n");
+    printf("  -n  number of instructions to run, overrides -f\n");
+    printf("  -s  opcodes executed per second of emulated time (default 700)\n");
+    printf("  -q  quirk profile: default, cosmac or superchip\n");
+    printf("  -S  seed of CXNN's random numbers (default 1)\n");
+    printf("  -w  keep this many seconds of rewind history and report its cost\n");
+    printf("  -o  write a savestate of the final machine\n");
+    printf("  -P  write execution counts to prefix.json, prefix-*.csv and prefix.lst (PROFILE=1 builds)\n");
+    printf("  -j  run on the x86-64 JIT instead of the interpreter\n");
+    printf("  -F  profile opcode pairs and fuse hot ones into superinstructions (BLOCK engine)\n");
+    printf("  -I  run idle loops instead of skipping to the next frame\n");
+    printf("  -R  run in real time at 60 frames a second and report the pacing\n");
+    printf("  -d  print the final display\n");
+}
+
+static void PrintDisplay(const uint64_t* display)
+{
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        char line[DISPLAY_WIDTH + 1];
+        for (int x = 0; x < DISPLAY_WIDTH; x++)
+            line[x] = (display[y] >> (DISPLAY_WIDTH - 1 - x)) & 1 ? '#' : '.';
+        line[DISPLAY_WIDTH] = '\0';
+        printf("%s\n", line);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::string romName = argv[1];
+    long long frames = 600;
+    long long instructions = -1;
+    int opcodesPerSecond = 700;
+    bool dumpDisplay = false;
+    bool useJit = false;
+    bool useFusion = false;
+    bool realTime = false;
+    bool idleSkip = true;
+    int rewindSeconds = 0;
+    std::string saveName;
+    std::string profileName;
+    uint64_t seed = DEFAULT_RANDOM_SEED;
+    QuirkProfile quirks = QUIRKS_DEFAULT;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-f") && i + 1 < argc)
+            frames = atoll(argv[++i]);
+        else if (0 == strcmp(argv[i], "-n") && i + 1 < argc)
+            instructions = atoll(argv[++i]);
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            opcodesPerSecond = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-q") && i + 1 < argc)
+        {
+            if (!Chip8::ParseQuirkProfile(argv[++i], quirks))
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (0 == strcmp(argv[i], "-S") && i + 1 < argc)
+            seed = strtoull(argv[++i], 0, 0);
+        else if (0 == strcmp(argv[i], "-w") && i + 1 < argc)
+            rewindSeconds = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-o") && i + 1 < argc)
+            saveName = argv[++i];
+        else if (0 == strcmp(argv[i], "-P") && i + 1 < argc)
+            profileName = argv[++i];
+        else if (0 == strcmp(argv[i], "-j"))
+            useJit = true;
+        else if (0 == strcmp(argv[i], "-F"))
+            useFusion = true;
+        else if (0 == strcmp(argv[i], "-I"))
+            idleSkip = false;
+        else if (0 == strcmp(argv[i], "-R"))
+            realTime = true;
+        else if (0 == strcmp(argv[i], "-d"))
+            dumpDisplay = true;
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // a movie brings its own rom, quirks, seed, speed and run length
+    Movie movie;
+    bool replaying = IsMovieFile(romName);
+    if (replaying)
+    {
+        if (!movie.Load(romName))
+        {
+            fprintf(stderr, "Failed to load movie %s\n", romName.c_str());
+            return 1;
+        }
+        quirks = movie.GetQuirkProfile();
+        seed = movie.GetRandomSeed();
+        opcodesPerSecond = movie.GetOpcodesPerSecond();
+        instructions = movie.GetEndInstruction();
+    }
+
+    // frames run FramePacer::GetBudget instructions each, as in the emulator
+    const int fps = 60;
+
+    // when an instruction count is given run as many frames as it needs
+    bool untilInstructions = instructions >= 0;
+    if (!untilInstructions)
+        instructions = (long long)frames * opcodesPerSecond / fps;
+
+    Chip8 machine;
+    Chip8* cpu = &machine;
+    // a savestate carries the generator's state, the seed only matters on reset
+    cpu->SetRandomSeed(seed);
+    double resumeSeconds = -1;
+    if (IsSaveStateFile(romName))
+    {
+        std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+        if (!ReadSaveState(romName, *cpu))
+        {
+            fprintf(stderr, "Failed to load savestate %s\n", romName.c_str());
+            return 1;
+        }
+        resumeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+    }
+    else if (!cpu->LoadRom(replaying ? movie.GetRomName() : romName, quirks))
+    {
+        fprintf(stderr, "Failed to load Chip8 ROM %s\n", replaying ? movie.GetRomName().c_str() : romName.c_str());
+        return 1;
+    }
+
+    if (!profileName.empty() && !cpu->GetExecutionProfile())
+    {
+        fprintf(stderr, "Execution profiling needs a build with PROFILE=1\n");
+        return 1;
+    }
+
+    // a profile counts every instruction of the wait loops it is meant to show
+    cpu->EnableIdleSkip(idleSkip && profileName.empty());
+    cpu->SetOpcodesPerSecond(opcodesPerSecond);
+
+    if (useJit && !cpu->EnableJit(true))
+    {
+        fprintf(stderr, "The JIT is not available on this host\n");
+        return 1;
+    }
+
+    // profile the first instructions, or the first tenth of a short run
+    const long long FUSION_PROFILE = 100000;
+    if (useFusion && !cpu->EnableFusion(instructions / 10 < FUSION_PROFILE ? instructions / 10 + 1 : FUSION_PROFILE))
+    {
+        fprintf(stderr, "Superinstruction fusion needs the BLOCK dispatch engine without the JIT\n");
+        return 1;
+    }
+
+#if defined(CHIP8_AOT)
+    AotRuntime aot(GetAotProgram());
+#endif
+
+    // capture time is measured on its own and left out of the throughput
+    std::unique_ptr<RewindBuffer> rewind;
+    if (rewindSeconds > 0)
+        rewind.reset(new RewindBuffer(rewindSeconds * fps));
+    double captureSeconds = 0;
+
+    // Without input, rewind captures or pacing nothing happens between
+    // frames, and the timers follow the instruction count, so the run can
+    // go in as few calls as possible. It still runs the instructions the
+    // frames would have
+    bool frameless = !replaying && !rewind && !realTime;
+    if (frameless && !untilInstructions)
+    {
+        instructions = 0;
+        for (long long frame = 0; frame < frames; frame++)
+            instructions += FramePacer::GetBudget(cpu->GetInstructionCount() + instructions, opcodesPerSecond, fps);
+    }
+    else if (frameless)
+    {
+        frames = (instructions * fps + opcodesPerSecond - 1) / opcodesPerSecond;
+    }
+
+    long long executed = 0;
+    size_t nextEvent = 0;
+    FramePacer pacer(fps);
+    std::clock_t startClock = std::clock();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    while (frameless && executed < instructions)
+    {
+        int count = instructions - executed < INT_MAX ? (int)(instructions - executed) : INT_MAX;
+#if defined(CHIP8_AOT)
+        aot.Execute(*cpu, count);
+#else
+        cpu->ExecuteOpcodes(count);
+#endif
+        executed += count;
+    }
+
+    // same order of work as EMU_LOOP
+    long long frame = 0;
+    for (; !frameless && (untilInstructions ? executed < instructions : frame < frames); frame++)
+    {
+        if (rewind)
+        {
+            std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+            rewind->Push(*cpu);
+            captureSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+        }
+
+        // recorded input arrives between frames, as it did from HandleInput
+        if (replaying)
+            nextEvent = movie.Feed(*cpu, nextEvent);
+
+        int count = FramePacer::GetBudget(cpu->GetInstructionCount(), opcodesPerSecond, fps);
+        if (untilInstructions && instructions - executed < count)
+            count = (int)(instructions - executed);
+
+#if defined(CHIP8_AOT)
+        aot.Execute(*cpu, count);
+#else
+        cpu->ExecuteOpcodes(count);
+#endif
+        executed += count;
+
+        if (realTime)
+            pacer.Wait();
+    }
+    if (!frameless)
+        frames = frame;
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count() - captureSeconds;
+    double cpuSeconds = (double)(std::clock() - startClock) / CLOCKS_PER_SEC;
+
+    printf("rom:           %s\n", romName.c_str());
+#if defined(CHIP8_AOT)
+    printf("dispatch:      aot (%s)\n", GetAotProgram().romName);
+#else
+    printf("dispatch:      %s\n", cpu->IsJitEnabled() ? "jit" : Chip8::GetDispatchEngine());
+#endif
+    printf("quirks:        %s\n", Chip8::GetQuirkProfileName(cpu->GetQuirkProfile()));
+    printf("seed:          %llu\n", (unsigned long long)cpu->GetRandomSeed());
+    printf("frames:        %lld\n", frames);
+    printf("instructions:  %lld\n", executed);
+    printf("elapsed:       %.6f s\n", seconds);
+    if (seconds > 0)
+        printf("throughput:    %.0f instructions/s\n", executed / seconds);
+    printf("ns/opcode:     %.2f\n", executed > 0 ? seconds * 1e9 / executed : 0.0);
+    printf("idle skipped:  %lld instructions, %.1f%%\n", cpu->GetIdleSkipCount(),
+           executed > 0 ? 100.0 * cpu->GetIdleSkipCount() / executed : 0.0);
+    if (realTime)
+    {
+        printf("pacing:        %.1f us late on average, %.1f us at most, %lld restarts\n",
+               pacer.GetMeanLateness() * 1e6, pacer.GetMaxLateness() * 1e6, pacer.GetRestartCount());
+        printf("host cpu:      %.2f%% of a core\n", seconds > 0 ? 100.0 * cpuSeconds / seconds : 0.0);
+    }
+
+    const BYTE* registers = cpu->GetRegisters();
+    printf("PC=%03X I=%03X DT=%02X ST=%02X\n", cpu->GetProgramCounter(), cpu->GetAddressI(),
+           cpu->GetDelayTimer(), cpu->GetSoundTimer());
+    for (int i = 0; i < 16; i++)
+        printf("V%X=%02X%c", i, registers[i], i == 15 ? '\n' : ' ');
+    printf("display hash:  %016llx\n", (unsigned long long)cpu->GetDisplayHash());
+
+    bool replayMatches = true;
+    if (replaying)
+    {
+        replayMatches = cpu->GetDisplayHash() == movie.GetEndDisplayHash();
+        printf("movie:         %zu key events from %s, recorded display hash %016llx, %s\n", movie.GetEventCount(),
+               movie.GetRomName().c_str(), (unsigned long long)movie.GetEndDisplayHash(),
+               replayMatches ? "replay matches" : "replay differs");
+    }
+
+    if (!profileName.empty())
+    {
+        const ExecutionProfile* profile = cpu->GetExecutionProfile();
+        profile->PrintSummary(stdout, 10);
+
+        Chip8State state;
+        cpu->SaveState(state);
+        if (!profile->WriteFiles(profileName.c_str(), state.memory))
+        {
+            fprintf(stderr, "Failed to write the execution profile to %s\n", profileName.c_str());
+            return 1;
+        }
+        printf("profile:       %s.json, %s-*.csv, %s.lst\n", profileName.c_str(), profileName.c_str(), profileName.c_str());
+    }
+
+    if (resumeSeconds >= 0)
+        printf("resumed:       %.2f us to map, check and load the savestate\n", resumeSeconds * 1e6);
+
+    // before the rewind below changes the machine
+    if (!saveName.empty())
+    {
+        SaveStateWriter writer;
+        std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+        writer.Save(saveName, *cpu);
+        double captureSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+        writer.Wait();
+        double writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+
+        if (writer.GetFailedCount())
+        {
+            fprintf(stderr, "Failed to write savestate %s\n", saveName.c_str());
+            return 1;
+        }
+        printf("saved:         %s, %.2f us on the emulation thread, %.2f us until written\n", saveName.c_str(),
+               captureSeconds * 1e6, writeSeconds * 1e6);
+    }
+
+    if (rewind)
+    {
+        int held = rewind->GetFrameCount();
+        size_t bytes = rewind->GetMemoryUsage();
+        printf("rewind:        %d frames in %zu bytes, %.1f bytes/frame, %.2f us/capture\n", held, bytes,
+               held ? (double)bytes / held : 0.0, frames ? captureSeconds * 1e6 / frames : 0.0);
+
+        // step all the way back, as holding the rewind key would
+        std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+        int restored = 0;
+        while (rewind->Pop(*cpu))
+            restored++;
+        double restoreSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+        printf("rewound:       %d frames to PC=%03X, %.2f us/restore\n", restored, cpu->GetProgramCounter(),
+               restored ? restoreSeconds * 1e6 / restored : 0.0);
+    }
+
+    if (cpu->GetFusionProfile())
+        cpu->GetFusionProfile()->PrintReport(stdout);
+
+    if (dumpDisplay)
+        PrintDisplay(cpu->GetDisplay());
+
+    return replayMatches ? 0 : 1;
+}
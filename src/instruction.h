@@ -0,0 +1,28 @@
+#pragma once
+
+typedef unsigned char BYTE; 
+typedef unsigned short int WORD;
+
+// Handler index for each opcode, in the order of the Chip8 handler tables
+enum OpcodeId
+{
+    OP_00E0, OP_00EE, OP_1NNN, OP_2NNN, OP_3XNN, OP_4XNN, OP_5XY0, OP_6XNN,
+    OP_7XNN, OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6,
+    OP_8XY7, OP_8XYE, OP_9XY0, OP_ANNN, OP_BNNN, OP_CXNN, OP_DXYN, OP_EX9E,
+    OP_EXA1, OP_FX07, OP_FX0A, OP_FX15, OP_FX18, OP_FX1E, OP_FX29, OP_FX33,
+    OP_FX55, OP_FX65, OP_NONE,
+    // superinstructions, only produced by the block cache when fusion is on
+    OP_6XNN_6XNN, OP_7XNN_7XNN, OP_ANNN_DXYN, OP_7XNN_3XNN_1NNN, OP_FX07_3XNN_1NNN,
+    OP_COUNT
+};
+
+// An opcode with its handler and operand fields already extracted
+struct Instruction
+{
+    BYTE handler ; // OpcodeId
+    BYTE x ;       // _X__
+    BYTE y ;       // __Y_
+    BYTE n ;       // ___N
+    BYTE nn ;      // __NN
+    WORD nnn ;     // _NNN
+};
@@ -0,0 +1,309 @@
+#include "jit.h"
+#include "blockcache.h"
+#include "chip8.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define CHIP8_JIT_X64
+#include <sys/mman.h>
+#endif
+
+// executable memory reserved per instance, flushed when full
+const size_t JIT_CODE_SIZE = 1 << 20 ;
+
+// worst case size of one translated block
+const size_t JIT_MAX_BLOCK_SIZE = MAX_BLOCK_LENGTH * 48 + 64 ;
+
+// x86 register numbers
+const int RAX = 0 ;
+const int RCX = 1 ;
+const int RDX = 2 ;
+const int RBX = 3 ;
+
+// condition codes for cmovcc
+const BYTE CC_E = 0x4 ;
+const BYTE CC_NE = 0x5 ;
+
+Jit::Jit(const Chip8& cpu)
+    : m_Code(0)
+    , m_CodeSize(0)
+    , m_CodeUsed(0)
+{
+#if defined(CHIP8_JIT_X64)
+    void* code = mmap(0, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED)
+    {
+        m_Code = static_cast<BYTE*>(code);
+        m_CodeSize = JIT_CODE_SIZE;
+    }
+#endif
+
+    // the guest state is addressed relative to the Chip8 pointer in rbx
+    const BYTE* base = reinterpret_cast<const BYTE*>(&cpu);
+    m_RegistersOffset = (int32_t)(reinterpret_cast<const BYTE*>(cpu.m_Registers) - base);
+    m_AddressIOffset = (int32_t)(reinterpret_cast<const BYTE*>(&cpu.m_AddressI) - base);
+    m_ProgramCounterOffset = (int32_t)(reinterpret_cast<const BYTE*>(&cpu.m_ProgramCounter) - base);
+}
+
+Jit::~Jit()
+{
+#if defined(CHIP8_JIT_X64)
+    if (m_Code)
+        munmap(m_Code, m_CodeSize);
+#endif
+}
+
+bool Jit::IsSupported()
+{
+#if defined(CHIP8_JIT_X64)
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Jit::IsReady() const
+{
+    return m_Code != 0;
+}
+
+// Runs count instructions, translating blocks the first time they are reached.
+// A block longer than the remaining budget is finished on the interpreter.
+void Jit::Execute(Chip8& cpu, int count)
+{
+    if (!IsReady())
+    {
+        cpu.InterpretOpcodes(count);
+        return;
+    }
+
+    while (count > 0)
+    {
+        // addresses wrap at 4K
+        cpu.m_ProgramCounter &= 0x0FFF;
+
+        if (m_CodeUsed + JIT_MAX_BLOCK_SIZE > m_CodeSize)
+            Flush(cpu);
+
+        Block& block = cpu.m_BlockCache.Lookup(cpu.m_ProgramCounter, cpu.m_GameMemory, sizeof(cpu.m_GameMemory));
+        if (block.length > count)
+        {
+            cpu.InterpretOpcodes(count);
+            return;
+        }
+
+        if (!block.native)
+            block.native = Translate(block);
+
+        int length = block.length;
+        reinterpret_cast<NativeBlock>(const_cast<void*>(block.native))(&cpu);
+        count -= length;
+    }
+}
+
+// Drops all translations, the block cache goes with them since it holds the pointers
+void Jit::Flush(Chip8& cpu)
+{
+    cpu.m_BlockCache.Clear();
+    m_CodeUsed = 0;
+}
+
+// Exit from generated code into the interpreter's handler for one instruction
+void Jit::CallHandler(Chip8* cpu, uint64_t packed)
+{
+    Instruction ins;
+    memcpy(&ins, &packed, sizeof(ins));
+    cpu->ExecuteInstruction(ins);
+}
+
+const void* Jit::Translate(const Block& block)
+{
+    BYTE* entry = m_Code + m_CodeUsed;
+
+    Emit8(0x53);                        // push rbx
+    Emit8(0x48); Emit8(0x89); Emit8(0xFB); // mov rbx, rdi
+
+    bool exited = false;
+    for (int i = 0; i < block.length; i++)
+    {
+        const Instruction& ins = block.ops[i];
+        WORD next = block.start + (i + 1) * 2;
+
+        switch (ins.handler)
+        {
+            case OP_1NNN:
+                EmitSetProgramCounter(ins.nnn);
+                exited = true;
+                break;
+            case OP_3XNN: EmitSkip(CC_E, ins.x, -1, ins.nn, next); exited = true; break;
+            case OP_4XNN: EmitSkip(CC_NE, ins.x, -1, ins.nn, next); exited = true; break;
+            case OP_5XY0: EmitSkip(CC_E, ins.x, ins.y, 0, next); exited = true; break;
+            case OP_9XY0: EmitSkip(CC_NE, ins.x, ins.y, 0, next); exited = true; break;
+            default:
+                if (!EmitInline(ins))
+                {
+                    EmitCall(ins, next);
+
+                    // terminators have set the program counter themselves
+                    exited = BlockCache::EndsBlock(ins.handler);
+                }
+                break;
+        }
+    }
+
+    // blocks cut short by their length end by falling through
+    if (!exited)
+        EmitSetProgramCounter(block.start + block.length * 2);
+
+    Emit8(0x5B);                        // pop rbx
+    Emit8(0xC3);                        // ret
+
+    return entry;
+}
+
+// Registers, I and simple ALU ops. Ops that read or write VF through
+// Vx/Vy are left to the interpreter, which defines their odd ordering.
+bool Jit::EmitInline(const Instruction& ins)
+{
+    int x = ins.x;
+    int y = ins.y;
+    bool usesFlag = (x == 0xF || y == 0xF);
+
+    switch (ins.handler)
+    {
+        case OP_NONE:
+            return true;
+        case OP_6XNN:
+            EmitRegisterByte(0xC6, 0, x); Emit8(ins.nn); // mov byte [Vx], nn
+            return true;
+        case OP_7XNN:
+            EmitRegisterByte(0x80, 0, x); Emit8(ins.nn); // add byte [Vx], nn
+            return true;
+        case OP_8XY0:
+            EmitRegisterByte(0x8A, RAX, y);     // mov al, [Vy]
+            EmitRegisterByte(0x88, RAX, x);     // mov [Vx], al
+            return true;
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+        {
+            BYTE op = ins.handler == OP_8XY1 ? 0x08 : ins.handler == OP_8XY2 ? 0x20 : 0x30;
+            EmitRegisterByte(0x8A, RAX, y);     // mov al, [Vy]
+            EmitRegisterByte(op, RAX, x);       // or/and/xor [Vx], al
+            return true;
+        }
+        case OP_8XY4:
+        case OP_8XY5:
+        case OP_8XY7:
+        {
+            if (usesFlag)
+                return false;
+
+            int first = ins.handler == OP_8XY7 ? y : x;
+            int second = ins.handler == OP_8XY7 ? x : y;
+            EmitRegisterByte(0x8A, RAX, first); // mov al, [first]
+            if (ins.handler == OP_8XY4)
+            {
+                EmitRegisterByte(0x02, RAX, second); // add al, [second]
+                Emit8(0x0F); Emit8(0x92); Emit8(0xC1); // setc cl
+            }
+            else
+            {
+                EmitRegisterByte(0x2A, RAX, second); // sub al, [second]
+                Emit8(0x0F); Emit8(0x93); Emit8(0xC1); // setnc cl
+            }
+            EmitRegisterByte(0x88, RAX, x);     // mov [Vx], al
+            EmitRegisterByte(0x88, RCX, 0xF);   // mov [VF], cl
+            return true;
+        }
+        case OP_ANNN:
+            Emit8(0x66); Emit8(0xC7); EmitModRM(0, m_AddressIOffset); Emit16(ins.nnn); // mov word [I], nnn
+            return true;
+        case OP_FX1E:
+            Emit8(0x0F); Emit8(0xB6); EmitModRM(RAX, m_RegistersOffset + x); // movzx eax, byte [Vx]
+            Emit8(0x66); Emit8(0x01); EmitModRM(RAX, m_AddressIOffset);      // add word [I], ax
+            return true;
+        case OP_FX29:
+            Emit8(0x0F); Emit8(0xB6); EmitModRM(RAX, m_RegistersOffset + x); // movzx eax, byte [Vx]
+            Emit8(0x8D); Emit8(0x04); Emit8(0x80);                           // lea eax, [rax+rax*4]
+            Emit8(0x66); Emit8(0x89); EmitModRM(RAX, m_AddressIOffset);      // mov [I], ax
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Skip the next instruction when Vx compares equal/unequal to NN or Vy
+void Jit::EmitSkip(BYTE condition, int x, int y, int nn, WORD next)
+{
+    Emit8(0xB8); Emit32(next);                      // mov eax, next
+    Emit8(0x8D); Emit8(0x48); Emit8(0x02);          // lea ecx, [rax+2]
+    if (y < 0)
+    {
+        EmitRegisterByte(0x80, 7, x); Emit8(nn);    // cmp byte [Vx], nn
+    }
+    else
+    {
+        EmitRegisterByte(0x8A, RDX, x);             // mov dl, [Vx]
+        EmitRegisterByte(0x3A, RDX, y);             // cmp dl, [Vy]
+    }
+    Emit8(0x0F); Emit8(0x40 | condition); Emit8(0xC1); // cmovcc eax, ecx
+    Emit8(0x66); Emit8(0x89); EmitModRM(RAX, m_ProgramCounterOffset); // mov [PC], ax
+}
+
+// Calls the interpreter's handler with the program counter it would see
+void Jit::EmitCall(const Instruction& ins, WORD next)
+{
+    uint64_t packed = 0;
+    memcpy(&packed, &ins, sizeof(ins));
+
+    EmitSetProgramCounter(next);
+    Emit8(0x48); Emit8(0x89); Emit8(0xDF);          // mov rdi, rbx
+    Emit8(0x48); Emit8(0xBE); Emit64(packed);       // mov rsi, packed
+    Emit8(0x48); Emit8(0xB8); Emit64(reinterpret_cast<uint64_t>(&Jit::CallHandler)); // mov rax, CallHandler
+    Emit8(0xFF); Emit8(0xD0);                       // call rax
+}
+
+void Jit::EmitSetProgramCounter(WORD address)
+{
+    Emit8(0x66); Emit8(0xC7); EmitModRM(0, m_ProgramCounterOffset); Emit16(address); // mov word [PC], address
+}
+
+// op reg, byte [rbx + m_Registers + guest]
+void Jit::EmitRegisterByte(BYTE opcode, int reg, int guest)
+{
+    Emit8(opcode);
+    EmitModRM(reg, m_RegistersOffset + guest);
+}
+
+// [rbx + disp32] operand
+void Jit::EmitModRM(int reg, int32_t disp)
+{
+    Emit8(0x80 | (reg << 3) | RBX);
+    Emit32((uint32_t)disp);
+}
+
+void Jit::Emit8(BYTE value)
+{
+    m_Code[m_CodeUsed++] = value;
+}
+
+void Jit::Emit16(WORD value)
+{
+    memcpy(m_Code + m_CodeUsed, &value, sizeof(value));
+    m_CodeUsed += sizeof(value);
+}
+
+void Jit::Emit32(uint32_t value)
+{
+    memcpy(m_Code + m_CodeUsed, &value, sizeof(value));
+    m_CodeUsed += sizeof(value);
+}
+
+void Jit::Emit64(uint64_t value)
+{
+    memcpy(m_Code + m_CodeUsed, &value, sizeof(value));
+    m_CodeUsed += sizeof(value);
+}
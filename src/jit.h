@@ -0,0 +1,57 @@
+#pragma once
+#include "instruction.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Chip8;
+struct Block;
+
+// Translates blocks from the Chip8 block cache into x86-64 code.
+//
+// The generated code keeps a pointer to the Chip8 object in rbx and works
+// on m_Registers, m_AddressI and m_ProgramCounter in place. Register ALU
+// ops, loads, I updates, jumps and register skips are emitted inline.
+// Everything that needs the host or has a quirk-dependent behaviour
+// (drawing, keys, random numbers, timers, the stack and memory stores)
+// calls back into the interpreter's opcode handler.
+class Jit
+{
+public:
+    explicit Jit(const Chip8& cpu);
+    ~Jit();
+
+    static bool IsSupported();
+    bool IsReady() const;
+
+    void Execute(Chip8& cpu, int count);
+
+private:
+    typedef void (*NativeBlock)(Chip8* cpu);
+
+    const void* Translate(const Block& block);
+    void Flush(Chip8& cpu);
+
+    static void CallHandler(Chip8* cpu, uint64_t packed);
+
+    // code emission
+    void Emit8(BYTE value);
+    void Emit16(WORD value);
+    void Emit32(uint32_t value);
+    void Emit64(uint64_t value);
+    void EmitModRM(int reg, int32_t disp);
+    void EmitRegisterByte(BYTE opcode, int reg, int guest);
+    void EmitSetProgramCounter(WORD address);
+    void EmitCall(const Instruction& ins, WORD next);
+    void EmitSkip(BYTE condition, int x, int y, int nn, WORD next);
+    bool EmitInline(const Instruction& ins);
+
+    BYTE* m_Code ;
+    size_t m_CodeSize ;
+    size_t m_CodeUsed ;
+
+    // offsets of the guest state inside Chip8
+    int32_t m_RegistersOffset ;
+    int32_t m_AddressIOffset ;
+    int32_t m_ProgramCounterOffset ;
+};
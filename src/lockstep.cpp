@@ -0,0 +1,582 @@
+#include "lockstep.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Register rows are either the same row or disjoint, so a lane only ever
+// depends on itself and the loops are safe to vectorise without alias checks
+#if defined(__clang__)
+#define LANE_LOOP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define LANE_LOOP _Pragma("GCC ivdep")
+#else
+#define LANE_LOOP
+#endif
+
+#define FOR_EACH_LANE(l) LANE_LOOP for (int l = 0; l < LOCKSTEP_LANES; l++)
+
+// Lane masks hold 0x00 or 0xFF, so selecting is a blend rather than a branch
+static inline BYTE Select(BYTE mask, BYTE value, BYTE old)
+{
+    return (value & mask) | (old & ~mask);
+}
+
+static inline WORD SelectWord(BYTE mask, WORD value, WORD old)
+{
+    WORD wide = (WORD)(int16_t)(int8_t)mask;
+    return (value & wide) | (old & ~wide);
+}
+
+static inline BYTE MaskOf(bool condition)
+{
+    return condition ? 0xFF : 0x00;
+}
+
+LockstepMachines::LockstepMachines()
+    : m_Quirks(QUIRKS_DEFAULT)
+    , m_RandomSeed(DEFAULT_RANDOM_SEED)
+    , m_OpcodesPerSecond(DEFAULT_OPCODES_PER_SECOND)
+    , m_Tick(0)
+    , m_Steps(0)
+    , m_Groups(0)
+{
+    LoadRom("", QUIRKS_DEFAULT) ;
+}
+
+// Loads the ROM into every lane, an empty name just resets the lanes
+bool LockstepMachines::LoadRom(const std::string& romname, QuirkProfile quirks)
+{
+    memset(m_Registers,0,sizeof(m_Registers)) ;
+    memset(m_AddressI,0,sizeof(m_AddressI)) ;
+    memset(m_DelayExpiry,0,sizeof(m_DelayExpiry)) ;
+    memset(m_SoundExpiry,0,sizeof(m_SoundExpiry)) ;
+    memset(m_Stack,0,sizeof(m_Stack)) ;
+    memset(m_StackPointer,0,sizeof(m_StackPointer)) ;
+    memset(m_KeyState,0,sizeof(m_KeyState)) ;
+    memset(m_Display,0,sizeof(m_Display)) ;
+    memset(m_Written,0,sizeof(m_Written)) ;
+    FOR_EACH_LANE(l)
+        m_ProgramCounter[l] = 0x200 ;
+    FOR_EACH_LANE(l)
+        m_RandomState[l] = SeedRandom(m_RandomSeed) ;
+
+    m_Quirks = quirks ;
+    m_Steps = 0 ;
+    m_Groups = 0 ;
+
+    bool loaded = true ;
+    memset(m_Rom,0,sizeof(m_Rom)) ;
+    if (!romname.empty())
+    {
+        FILE* in = fopen(romname.c_str(), "rb") ;
+        if (0 == in)
+            loaded = false ;
+        else
+        {
+            fread(&m_Rom[0x200], 1, sizeof(m_Rom) - 0x200, in) ;
+            fclose(in) ;
+        }
+    }
+
+    FOR_EACH_LANE(l)
+        memcpy(m_GameMemory[l], m_Rom, sizeof(m_Rom)) ;
+
+    return loaded ;
+}
+
+void LockstepMachines::SetRandomSeed(uint64_t seed)
+{
+    m_RandomSeed = seed ;
+    FOR_EACH_LANE(l)
+        m_RandomState[l] = SeedRandom(seed) ;
+}
+
+// Only between calls, when every lane has run the same number of instructions
+void LockstepMachines::SetOpcodesPerSecond(int opcodesPerSecond)
+{
+    BYTE delay[LOCKSTEP_LANES], sound[LOCKSTEP_LANES] ;
+    FOR_EACH_LANE(l)
+    {
+        delay[l] = GetDelayTimer(l) ;
+        sound[l] = GetSoundTimer(l) ;
+    }
+    m_OpcodesPerSecond = opcodesPerSecond > 0 ? opcodesPerSecond : DEFAULT_OPCODES_PER_SECOND ;
+    uint64_t now = Chip8::GetTimerTicks(m_Steps, m_OpcodesPerSecond) ;
+    FOR_EACH_LANE(l)
+    {
+        m_DelayExpiry[l] = now + delay[l] ;
+        m_SoundExpiry[l] = now + sound[l] ;
+    }
+}
+
+void LockstepMachines::KeyPressed(int lane, int key)
+{
+    m_KeyState[key][lane] = 1 ;
+}
+
+void LockstepMachines::KeyReleased(int lane, int key)
+{
+    m_KeyState[key][lane] = 0 ;
+}
+
+WORD LockstepMachines::GetProgramCounter(int lane) const
+{
+    return m_ProgramCounter[lane] ;
+}
+
+WORD LockstepMachines::GetAddressI(int lane) const
+{
+    return m_AddressI[lane] ;
+}
+
+BYTE LockstepMachines::GetRegister(int lane, int index) const
+{
+    return m_Registers[index][lane] ;
+}
+
+static inline BYTE GetTimerValue(uint64_t expiry, uint64_t tick)
+{
+    return expiry > tick ? (BYTE)(expiry - tick) : 0 ;
+}
+
+BYTE LockstepMachines::GetDelayTimer(int lane) const
+{
+    return GetTimerValue(m_DelayExpiry[lane], Chip8::GetTimerTicks(m_Steps, m_OpcodesPerSecond)) ;
+}
+
+BYTE LockstepMachines::GetSoundTimer(int lane) const
+{
+    return GetTimerValue(m_SoundExpiry[lane], Chip8::GetTimerTicks(m_Steps, m_OpcodesPerSecond)) ;
+}
+
+uint64_t LockstepMachines::GetDisplayHash(int lane) const
+{
+    uint64_t rows[DISPLAY_HEIGHT] ;
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        rows[y] = m_Display[y][lane] ;
+    return Chip8::HashDisplay(rows) ;
+}
+
+long long LockstepMachines::GetSteps() const
+{
+    return m_Steps ;
+}
+
+long long LockstepMachines::GetGroups() const
+{
+    return m_Groups ;
+}
+
+WORD LockstepMachines::Fetch(int lane, WORD address) const
+{
+    return m_GameMemory[lane][address] << 8 | m_GameMemory[lane][(address + 1) & 0x0FFF] ;
+}
+
+bool LockstepMachines::IsWritten(int address, int length) const
+{
+    for (int i = 0; i < length; i++)
+    {
+        int at = (address + i) & 0x0FFF ;
+        if (m_Written[at / 64] & (1ULL << (at % 64)))
+            return true ;
+    }
+    return false ;
+}
+
+void LockstepMachines::MarkWritten(int address, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        int at = (address + i) & 0x0FFF ;
+        m_Written[at / 64] |= 1ULL << (at % 64) ;
+    }
+}
+
+// In the same timer slices as Chip8::ExecuteOpcodes, so every lane sees
+// one tick for the whole of each slice
+void LockstepMachines::ExecuteOpcodes(int count)
+{
+    while (count > 0)
+    {
+        m_Tick = Chip8::GetTimerTicks(m_Steps + 1, m_OpcodesPerSecond) ;
+        uint64_t next = m_Tick * m_OpcodesPerSecond / TIMER_HZ ;
+        int slice = next - m_Steps < (uint64_t)count ? (int)(next - m_Steps) : count ;
+        count -= slice ;
+
+        switch (m_Quirks)
+        {
+            case QUIRKS_COSMAC: InterpretOpcodesWith<CosmacQuirks>(slice); break;
+            case QUIRKS_SUPERCHIP: InterpretOpcodesWith<SuperChipQuirks>(slice); break;
+            default: InterpretOpcodesWith<DefaultQuirks>(slice); break;
+        }
+    }
+}
+
+// Every lane runs count instructions, but lanes never share state, so the
+// order they run them in is free. The lane furthest behind in the program
+// leads a group of all lanes with budget left at the same address with the
+// same opcode, and lanes further on wait for it. Lanes that split at a
+// branch then meet again where the paths join, instead of staying out of
+// step for the rest of the call.
+template <class Quirks>
+void LockstepMachines::InterpretOpcodesWith(int count)
+{
+    int remaining[LOCKSTEP_LANES] ;
+    FOR_EACH_LANE(l)
+        remaining[l] = count ;
+
+    for (;;)
+    {
+        // lanes out of budget sort last
+        WORD key[LOCKSTEP_LANES] ;
+        FOR_EACH_LANE(l)
+            key[l] = remaining[l] > 0 ? (m_ProgramCounter[l] & 0x0FFF) : 0xFFFF ;
+
+        WORD pc = 0xFFFF ;
+        FOR_EACH_LANE(l)
+            pc = key[l] < pc ? key[l] : pc ;
+        if (0xFFFF == pc)
+            break ;
+
+        LaneMask mask ;
+        FOR_EACH_LANE(l)
+            mask[l] = MaskOf(key[l] == pc) ;
+
+        WORD opcode ;
+        if (!IsWritten(pc, 2))
+        {
+            // no lane has stored here, so every lane holds the ROM's opcode
+            opcode = m_Rom[pc] << 8 | m_Rom[(pc + 1) & 0x0FFF] ;
+        }
+        else
+        {
+            int leader = 0 ;
+            while (!mask[leader])
+                leader++ ;
+
+            opcode = Fetch(leader, pc) ;
+            FOR_EACH_LANE(l)
+                mask[l] &= MaskOf(Fetch(l, pc) == opcode) ;
+        }
+
+        FOR_EACH_LANE(l)
+            remaining[l] -= mask[l] & 1 ;
+
+        m_Groups++ ;
+        Execute<Quirks>(Chip8::s_DecodeTable[opcode], mask) ;
+    }
+
+    m_Steps += count ;
+}
+
+// Runs one decoded instruction on the lanes in mask, in the same order of
+// reads and writes as the matching Chip8 handler
+template <class Quirks>
+void LockstepMachines::Execute(const Instruction& ins, const LaneMask laneMask)
+{
+    // a local copy cannot alias the state, which lets the lane loops vectorise
+    LaneMask mask ;
+    memcpy(mask, laneMask, sizeof(mask)) ;
+
+    BYTE* vx = m_Registers[ins.x] ;
+    BYTE* vy = m_Registers[ins.y] ;
+    BYTE* vf = m_Registers[0xF] ;
+
+    FOR_EACH_LANE(l)
+        m_ProgramCounter[l] = SelectWord(mask[l], m_ProgramCounter[l] + 2, m_ProgramCounter[l]) ;
+
+    switch (ins.handler)
+    {
+        case OP_00E0:
+            for (int y = 0; y < DISPLAY_HEIGHT; y++)
+                FOR_EACH_LANE(l)
+                    m_Display[y][l] &= ~(uint64_t)(int64_t)(int8_t)mask[l] ;
+            break ;
+        case OP_00EE:
+            FOR_EACH_LANE(l)
+            {
+                if (mask[l])
+                {
+                    m_StackPointer[l] = (m_StackPointer[l] - 1) & 0xF ;
+                    m_ProgramCounter[l] = m_Stack[m_StackPointer[l]][l] ;
+                }
+            }
+            break ;
+        case OP_1NNN:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] = SelectWord(mask[l], ins.nnn, m_ProgramCounter[l]) ;
+            break ;
+        case OP_2NNN:
+            FOR_EACH_LANE(l)
+            {
+                if (mask[l])
+                {
+                    m_Stack[m_StackPointer[l]][l] = m_ProgramCounter[l] ;
+                    m_StackPointer[l] = (m_StackPointer[l] + 1) & 0xF ;
+                    m_ProgramCounter[l] = ins.nnn ;
+                }
+            }
+            break ;
+        case OP_3XNN:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] += 2 & SelectWord(mask[l] & MaskOf(vx[l] == ins.nn), 0xFFFF, 0) ;
+            break ;
+        case OP_4XNN:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] += 2 & SelectWord(mask[l] & MaskOf(vx[l] != ins.nn), 0xFFFF, 0) ;
+            break ;
+        case OP_5XY0:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] += 2 & SelectWord(mask[l] & MaskOf(vx[l] == vy[l]), 0xFFFF, 0) ;
+            break ;
+        case OP_9XY0:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] += 2 & SelectWord(mask[l] & MaskOf(vx[l] != vy[l]), 0xFFFF, 0) ;
+            break ;
+        case OP_6XNN:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], ins.nn, vx[l]) ;
+            break ;
+        case OP_7XNN:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] + ins.nn, vx[l]) ;
+            break ;
+        case OP_8XY0:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vy[l], vx[l]) ;
+            break ;
+        case OP_8XY1:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] | vy[l], vx[l]) ;
+            break ;
+        case OP_8XY2:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] & vy[l], vx[l]) ;
+            break ;
+        case OP_8XY3:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] ^ vy[l], vx[l]) ;
+            break ;
+        case OP_8XY4:
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l], 0, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l] & MaskOf(vx[l] + vy[l] > 255), 1, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] + vy[l], vx[l]) ;
+            break ;
+        case OP_8XY5:
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l], 1, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l] & MaskOf(vx[l] < vy[l]), 0, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] - vy[l], vx[l]) ;
+            break ;
+        case OP_8XY6:
+            if (Quirks::SHIFT_READS_VY)
+                FOR_EACH_LANE(l)
+                    vx[l] = Select(mask[l], vy[l], vx[l]) ;
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l], vx[l] & 0x1, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] >> 1, vx[l]) ;
+            break ;
+        case OP_8XY7:
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l], 1, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l] & MaskOf(vy[l] < vx[l]), 0, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vy[l] - vx[l], vx[l]) ;
+            break ;
+        case OP_8XYE:
+            if (Quirks::SHIFT_READS_VY)
+                FOR_EACH_LANE(l)
+                    vx[l] = Select(mask[l], vy[l], vx[l]) ;
+            FOR_EACH_LANE(l)
+                vf[l] = Select(mask[l], vx[l] >> 7, vf[l]) ;
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], vx[l] << 1, vx[l]) ;
+            break ;
+        case OP_ANNN:
+            FOR_EACH_LANE(l)
+                m_AddressI[l] = SelectWord(mask[l], ins.nnn, m_AddressI[l]) ;
+            break ;
+        case OP_BNNN:
+        {
+            const BYTE* offset = m_Registers[Quirks::JUMP_ADDS_VX ? ins.x : 0] ;
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] = SelectWord(mask[l], ins.nnn + offset[l], m_ProgramCounter[l]) ;
+            break ;
+        }
+        case OP_CXNN:
+            // only the lanes that run it advance their generator
+            FOR_EACH_LANE(l)
+            {
+                uint64_t state = m_RandomState[l] ;
+                BYTE value = NextRandom(state) & ins.nn ;
+                m_RandomState[l] = mask[l] ? state : m_RandomState[l] ;
+                vx[l] = Select(mask[l], value, vx[l]) ;
+            }
+            break ;
+        case OP_DXYN:
+            Draw<Quirks>(ins, mask) ;
+            break ;
+        case OP_EX9E:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] += 2 & SelectWord(mask[l] & MaskOf(m_KeyState[vx[l] & 0xF][l] == 1), 0xFFFF, 0) ;
+            break ;
+        case OP_EXA1:
+            FOR_EACH_LANE(l)
+                m_ProgramCounter[l] += 2 & SelectWord(mask[l] & MaskOf(m_KeyState[vx[l] & 0xF][l] != 1), 0xFFFF, 0) ;
+            break ;
+        case OP_FX07:
+            FOR_EACH_LANE(l)
+                vx[l] = Select(mask[l], GetTimerValue(m_DelayExpiry[l], m_Tick), vx[l]) ;
+            break ;
+        case OP_FX0A:
+            FOR_EACH_LANE(l)
+            {
+                if (!mask[l])
+                    continue ;
+
+                int key = 0 ;
+                while (key < 16 && 0 == m_KeyState[key][l])
+                    key++ ;
+
+                if (key == 16)
+                    m_ProgramCounter[l] -= 2 ;
+                else
+                    vx[l] = key ;
+            }
+            break ;
+        case OP_FX15:
+            FOR_EACH_LANE(l)
+                m_DelayExpiry[l] = mask[l] ? m_Tick + vx[l] : m_DelayExpiry[l] ;
+            break ;
+        case OP_FX18:
+            FOR_EACH_LANE(l)
+                m_SoundExpiry[l] = mask[l] ? m_Tick + vx[l] : m_SoundExpiry[l] ;
+            break ;
+        case OP_FX1E:
+            FOR_EACH_LANE(l)
+                m_AddressI[l] = SelectWord(mask[l], m_AddressI[l] + vx[l], m_AddressI[l]) ;
+            break ;
+        case OP_FX29:
+            FOR_EACH_LANE(l)
+                m_AddressI[l] = SelectWord(mask[l], vx[l] * 5, m_AddressI[l]) ;
+            break ;
+        case OP_FX33:
+            FOR_EACH_LANE(l)
+            {
+                if (!mask[l])
+                    continue ;
+
+                BYTE* memory = m_GameMemory[l] ;
+                WORD address = m_AddressI[l] ;
+                memory[address & 0x0FFF] = vx[l] / 100 ;
+                memory[(address + 1) & 0x0FFF] = (vx[l] / 10) % 10 ;
+                memory[(address + 2) & 0x0FFF] = vx[l] % 10 ;
+                MarkWritten(address, 3) ;
+            }
+            break ;
+        case OP_FX55:
+            FOR_EACH_LANE(l)
+            {
+                if (!mask[l])
+                    continue ;
+
+                for (int i = 0; i <= ins.x; i++)
+                    m_GameMemory[l][(m_AddressI[l] + i) & 0x0FFF] = m_Registers[i][l] ;
+                MarkWritten(m_AddressI[l], ins.x + 1) ;
+                if (Quirks::LOAD_STORE_ADVANCES_I)
+                    m_AddressI[l] += ins.x + 1 ;
+            }
+            break ;
+        case OP_FX65:
+            for (int i = 0; i <= ins.x; i++)
+                FOR_EACH_LANE(l)
+                    m_Registers[i][l] = Select(mask[l], m_GameMemory[l][(m_AddressI[l] + i) & 0x0FFF], m_Registers[i][l]) ;
+            if (Quirks::LOAD_STORE_ADVANCES_I)
+                FOR_EACH_LANE(l)
+                    m_AddressI[l] = SelectWord(mask[l], m_AddressI[l] + ins.x + 1, m_AddressI[l]) ;
+            break ;
+        default:
+            break ;
+    }
+}
+
+// Draws the sprite on every lane in mask. When the lanes draw the same
+// unmodified sprite at the same place, each sprite row is worked out once
+// and XORed into all lanes' display rows together.
+template <class Quirks>
+void LockstepMachines::Draw(const Instruction& ins, const LaneMask mask)
+{
+    int first = 0 ;
+    while (!mask[first])
+        first++ ;
+
+    WORD address = m_AddressI[first] ;
+    BYTE x = m_Registers[ins.x][first] ;
+    BYTE y = m_Registers[ins.y][first] ;
+
+    bool uniform = !IsWritten(address, ins.n) ;
+    for (int l = first + 1; l < LOCKSTEP_LANES && uniform; l++)
+        if (mask[l])
+            uniform = m_AddressI[l] == address && m_Registers[ins.x][l] == x && m_Registers[ins.y][l] == y ;
+
+    BYTE* vf = m_Registers[0xF] ;
+
+    if (uniform)
+    {
+        int coordx = x % DISPLAY_WIDTH ;
+        int coordy = y % DISPLAY_HEIGHT ;
+
+        LaneMask collision ;
+        FOR_EACH_LANE(l)
+            collision[l] = 0 ;
+
+        for (int yline = 0; yline < ins.n; yline++)
+        {
+            if (Quirks::CLIP_SPRITES && coordy + yline >= DISPLAY_HEIGHT)
+                break ;
+
+            uint64_t bits = SpriteRow<Quirks>(m_Rom[(address + yline) & 0x0FFF], coordx) ;
+            uint64_t* row = m_Display[(coordy + yline) % DISPLAY_HEIGHT] ;
+            FOR_EACH_LANE(l)
+            {
+                uint64_t laneBits = bits & (uint64_t)(int64_t)(int8_t)mask[l] ;
+                collision[l] |= MaskOf((row[l] & laneBits) != 0) ;
+                row[l] ^= laneBits ;
+            }
+        }
+
+        FOR_EACH_LANE(l)
+            vf[l] = Select(mask[l], collision[l] & 1, vf[l]) ;
+        return ;
+    }
+
+    FOR_EACH_LANE(l)
+    {
+        if (!mask[l])
+            continue ;
+
+        int coordx = m_Registers[ins.x][l] % DISPLAY_WIDTH ;
+        int coordy = m_Registers[ins.y][l] % DISPLAY_HEIGHT ;
+        vf[l] = 0 ;
+
+        for (int yline = 0; yline < ins.n; yline++)
+        {
+            if (Quirks::CLIP_SPRITES && coordy + yline >= DISPLAY_HEIGHT)
+                break ;
+
+            uint64_t bits = SpriteRow<Quirks>(m_GameMemory[l][(m_AddressI[l] + yline) & 0x0FFF], coordx) ;
+            uint64_t& row = m_Display[(coordy + yline) % DISPLAY_HEIGHT][l] ;
+            if (row & bits)
+                vf[l] = 1 ;
+            row ^= bits ;
+        }
+    }
+}
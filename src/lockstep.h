@@ -0,0 +1,82 @@
+#pragma once
+#include "chip8.h"
+
+#include <stdint.h>
+#include <string>
+
+// machines per LockstepMachines, one AVX2 register of bytes
+const int LOCKSTEP_LANES = 32 ;
+
+// A group of machines running the same ROM, stored as structure of arrays
+// with one column per machine ("lane"). Each step, the lanes sharing a
+// program counter and opcode run that opcode together under a lane mask.
+// Register, I, timer and skip updates are branch-free loops across the
+// lanes, which the compiler turns into SSE/AVX2 blends. Lanes that diverge
+// through their keys run in smaller groups until their program counters
+// meet again. Each lane draws random numbers from its own generator, so a
+// lane matches a Chip8 given the same seed and input.
+//
+// Behaves like Chip8 with the same quirk profile, except that addresses
+// wrap at 4K.
+class LockstepMachines
+{
+public:
+    LockstepMachines();
+
+    bool LoadRom(const std::string& romname, QuirkProfile quirks = QUIRKS_DEFAULT);
+    // every lane is seeded alike, as a Chip8 with the same seed
+    void SetRandomSeed(uint64_t seed);
+
+    // every lane runs count instructions
+    void ExecuteOpcodes(int count);
+    // timers tick as in Chip8::SetOpcodesPerSecond
+    void SetOpcodesPerSecond(int opcodesPerSecond);
+    void KeyPressed(int lane, int key);
+    void KeyReleased(int lane, int key);
+
+    WORD GetProgramCounter(int lane) const;
+    WORD GetAddressI(int lane) const;
+    BYTE GetRegister(int lane, int index) const;
+    BYTE GetDelayTimer(int lane) const;
+    BYTE GetSoundTimer(int lane) const;
+    uint64_t GetDisplayHash(int lane) const;
+
+    // instructions run per lane, and the lane groups they ran in
+    long long GetSteps() const;
+    long long GetGroups() const;
+
+private:
+    typedef BYTE LaneMask[LOCKSTEP_LANES];
+
+    template <class Quirks> void InterpretOpcodesWith(int count);
+    template <class Quirks> void Execute(const Instruction& ins, const LaneMask mask);
+    template <class Quirks> void Draw(const Instruction& ins, const LaneMask mask);
+
+    WORD Fetch(int lane, WORD address) const;
+    bool IsWritten(int address, int length) const;
+    void MarkWritten(int address, int length);
+
+    // state, indexed [what][lane]
+    BYTE m_Registers[16][LOCKSTEP_LANES] ;
+    WORD m_AddressI[LOCKSTEP_LANES] ;
+    WORD m_ProgramCounter[LOCKSTEP_LANES] ;
+    uint64_t m_DelayExpiry[LOCKSTEP_LANES] ; // tick each timer reaches zero on
+    uint64_t m_SoundExpiry[LOCKSTEP_LANES] ;
+    WORD m_Stack[16][LOCKSTEP_LANES] ;
+    BYTE m_StackPointer[LOCKSTEP_LANES] ;
+    BYTE m_KeyState[16][LOCKSTEP_LANES] ;
+    uint64_t m_Display[DISPLAY_HEIGHT][LOCKSTEP_LANES] ;
+    uint64_t m_RandomState[LOCKSTEP_LANES] ; // CXNN's generator per lane
+
+    // each lane has its own memory, but they only differ where a lane stored to
+    BYTE m_GameMemory[LOCKSTEP_LANES][0x1000] ;
+    BYTE m_Rom[0x1000] ;              // memory every lane started from
+    uint64_t m_Written[0x1000 / 64] ; // bytes any lane has stored to since the load
+
+    QuirkProfile m_Quirks ;
+    uint64_t m_RandomSeed ;
+    int m_OpcodesPerSecond ;
+    uint64_t m_Tick ;   // timer ticks seen by the slice running now
+    long long m_Steps ;
+    long long m_Groups ;
+};
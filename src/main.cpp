@@ -2,22 +2,53 @@
 #include <SDL2/SDL_opengl.h>
 
 #include "chip8.h"
-
+#include "movie.h"
+#include "pacer.h"
+#include "presenter.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "triplebuffer.h"
+
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include <map>
 #include <string>
 #include <fstream>
+#include <thread>
 
-// Define the width and height of the bytemap
-static const int WIDTH = 640;
-static const int HEIGHT = 320;
+// Define the initial width and height of the window, it can be resized
+static const int SCALE = 10;
+static const int WIDTH = DISPLAY_WIDTH * SCALE;
+static const int HEIGHT = DISPLAY_HEIGHT * SCALE;
 
 typedef std::map<std::string, std::string> SETTINGS_MAP ;
 
-void HandleInput(Chip8* cpu, SDL_Event* event, bool &quit);
+// Requests from the window thread to the emulation thread
+struct EmulatorControls
+{
+    std::atomic<uint16_t> keys ;   // a bit per key held down
+    std::atomic<uint16_t> taps ;   // a bit per key pressed since the last frame
+    std::atomic<bool> rewinding ;
+    std::atomic<bool> save ;       // taken by the emulation thread
+    std::atomic<bool> load ;
+    std::atomic<bool> quit ;
+
+    EmulatorControls() : keys(0), taps(0), rewinding(false), save(false), load(false), quit(false) {}
+};
+
+// A finished frame, handed from the emulation thread to the window thread
+struct DisplayFrame
+{
+    uint64_t display[DISPLAY_HEIGHT] ;
+    uint64_t number ;              // frames run since the emulator started
+};
+
+void HandleInput(EmulatorControls* controls, SDL_Event* event, const DisplayFrame& shown);
 bool GL_INIT();
+void FitViewport(SDL_Window* window, Presenter* presenter);
 void EMU_LOOP(Chip8* cpu, const SETTINGS_MAP& settings);
-void Render_Frame(Chip8* cpu);
+void Render_Frame(const uint64_t* display, uint32_t dirtyRows, Presenter* presenter);
 bool LoadGameSettings(SETTINGS_MAP& settings);
 bool CreateSDLWindow(SDL_Window** window, SDL_GLContext* glContext);
 bool LoadChip8Rom(Chip8* cpu, const SETTINGS_MAP& settings, std::string* romName);
@@ -30,7 +61,8 @@ int main(int argc, char* argv[]) {
     SDL_GLContext glContext;
 
     // Create a Chip8 CPU object
-    Chip8* cpu = Chip8::CreateSingleton();
+    Chip8 machine;
+    Chip8* cpu = &machine;
 
     // Create a map for storing settings
     SETTINGS_MAP settings;
@@ -67,7 +99,7 @@ int main(int argc, char* argv[]) {
 
 
 
-void HandleInput(Chip8* cpu, SDL_Event* event, bool &quit)
+void HandleInput(EmulatorControls* controls, SDL_Event* event, const DisplayFrame& shown)
 {
     if(event->type == SDL_KEYDOWN)
     {
@@ -90,15 +122,20 @@ void HandleInput(Chip8* cpu, SDL_Event* event, bool &quit)
 			case SDLK_r: key = 13 ; break;
 			case SDLK_f: key = 14 ; break;
 			case SDLK_v: key = 15 ; break;
-            case SDLK_ESCAPE: quit = true; break;
+            case SDLK_ESCAPE: controls->quit = true; break;
+            case SDLK_BACKSPACE: controls->rewinding = true; break;
+            case SDLK_F5: controls->save = true; break;
+            case SDLK_F9: controls->load = true; break;
             case SDLK_F12:
-                SaveScreenShot("./images/screenshot_" + std::to_string(cpu->GetProgramCounter()) + ".bmp");
+                SaveScreenShot("./images/screenshot_" + std::to_string(shown.number) + ".bmp");
                 // printf("Screenshot saved\n");
 			default: break ;
         }
         if(key!=-1)
         {
-            cpu->KeyPressed(key);
+            // a tap released before the next frame still reaches the machine
+            controls->keys.fetch_or(1 << key);
+            controls->taps.fetch_or(1 << key);
             // printf("Key pressed: %d\n", key);
         }
     }
@@ -123,12 +160,13 @@ void HandleInput(Chip8* cpu, SDL_Event* event, bool &quit)
 			case SDLK_r: key = 13 ; break;
 			case SDLK_f: key = 14 ; break;
 			case SDLK_v: key = 15 ; break;
+            case SDLK_BACKSPACE: controls->rewinding = false; break;
 			default: break ;
         }
         if(key!=-1)
         {
-            cpu->KeyReleased(key);
-            // printf("Key released: %d\n", key);  
+            controls->keys.fetch_and(~(1 << key));
+            // printf("Key released: %d\n", key);
         }
     }
 }
@@ -138,7 +176,6 @@ bool GL_INIT()
     glViewport(0,0,WIDTH,HEIGHT);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
-    glOrtho(0,WIDTH,0,HEIGHT,-1.0,1.0);
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glShadeModel(GL_FLAT);
@@ -152,6 +189,27 @@ bool GL_INIT()
     return true;
 }
 
+// The largest 2:1 area that fits the window, centred, with black bars
+// around it. glClear still clears the whole window
+void FitViewport(SDL_Window* window, Presenter* presenter)
+{
+    int width, height;
+    SDL_GL_GetDrawableSize(window, &width, &height);
+
+    int fitWidth = width;
+    int fitHeight = width * DISPLAY_HEIGHT / DISPLAY_WIDTH;
+    if (fitHeight > height)
+    {
+        fitHeight = height;
+        fitWidth = height * DISPLAY_WIDTH / DISPLAY_HEIGHT;
+    }
+    if (fitWidth < 1 || fitHeight < 1)
+        return;
+
+    glViewport((width - fitWidth) / 2, (height - fitHeight) / 2, fitWidth, fitHeight);
+    presenter->Resize(fitWidth, fitHeight);
+}
+
 void EMU_LOOP(Chip8* cpu, const SETTINGS_MAP& settings)
 {
     SETTINGS_MAP::const_iterator it = settings.find("OpcodesPerSecond") ;
@@ -165,52 +223,216 @@ void EMU_LOOP(Chip8* cpu, const SETTINGS_MAP& settings)
 
 	int fps = 60 ;
 
-	// number of opcodes to execute a second
+	// number of opcodes to execute a second, spread over the frames by
+	// FramePacer::GetBudget so none are lost to rounding
 	int numopcodes = atoi((*it).second.c_str()) ;
+	// the timers follow the machine's instruction count at this rate
+	cpu->SetOpcodesPerSecond( numopcodes ) ;
+
+	// optional length of the rewind history, in seconds
+	int rewindSeconds = 10 ;
+	it = settings.find("RewindSeconds") ;
+	if (settings.end() != it)
+		rewindSeconds = atoi((*it).second.c_str()) ;
+
+	RewindBuffer rewind(rewindSeconds * fps) ;
+
+	// F5 saves next to the rom, F9 loads it back. Writes happen on another thread
+	std::string savePath = settings.find("RomName")->second ;
+	size_t dot = savePath.find_last_of('.') ;
+	if (std::string::npos != dot && (std::string::npos == savePath.find_last_of('/') || dot > savePath.find_last_of('/')))
+		savePath.erase(dot) ;
+	savePath += SAVESTATE_EXTENSION ;
+	SaveStateWriter writer ;
+
+	// optional file to record the session's input to, replay it with chip8-headless
+	Movie movie ;
+	std::string moviePath ;
+	it = settings.find("RecordMovie") ;
+	if (settings.end() != it)
+	{
+		moviePath = (*it).second ;
+		movie.Start( settings.find("RomName")->second, cpu->GetQuirkProfile(), numopcodes, cpu->GetRandomSeed() ) ;
+	}
+	Movie* recording = moviePath.empty() ? 0 : &movie ;
 
-	// number of opcodes to execute a frame 
-	int numframe = numopcodes / fps ;
+	// optional presentation strategy, compare them with chip8-present
+	PresentStrategy strategy = PRESENT_SHADER ;
+	it = settings.find("Renderer") ;
+	if (settings.end() != it && !Presenter::ParseStrategy( (*it).second.c_str(), strategy ))
+	{
+		printf("Unknown Renderer setting %s, using shader\n", (*it).second.c_str()) ;
+		strategy = PRESENT_SHADER ;
+	}
+	Presenter presenter( strategy, WIDTH, HEIGHT ) ;
+	FitViewport( SDL_GL_GetCurrentWindow( ), &presenter ) ;
+
+	// optional colours and effects of the shader renderer
+	uint32_t offColour = 0xFFFFFF ;
+	uint32_t onColour = 0x000000 ;
+	it = settings.find("OffColour") ;
+	if (settings.end() != it)
+		offColour = strtoul( (*it).second.c_str(), 0, 16 ) ;
+	it = settings.find("OnColour") ;
+	if (settings.end() != it)
+		onColour = strtoul( (*it).second.c_str(), 0, 16 ) ;
+	presenter.SetPalette( offColour, onColour ) ;
+
+	float scanlines = 0 ;
+	float phosphor = 0 ;
+	it = settings.find("Scanlines") ;
+	if (settings.end() != it)
+		scanlines = atof( (*it).second.c_str() ) ;
+	it = settings.find("Phosphor") ;
+	if (settings.end() != it)
+		phosphor = atof( (*it).second.c_str() ) ;
+	presenter.SetEffects( scanlines, phosphor ) ;
+
+	EmulatorControls controls ;
+	TripleBuffer<DisplayFrame> frames ;
+
+	// The machine runs on its own thread, so a swap that blocks on the
+	// compositor or driver never delays emulation. This thread only polls
+	// events and presents the newest finished frame
+	std::thread emulation( [&]( )
+	{
+		FramePacer pacer( fps ) ;
+		uint16_t held = 0 ;
+		uint64_t number = 0 ;
+
+		while (!controls.quit)
+		{
+			// keys that changed since the last frame. A tap let go of before
+			// this frame is held for the frame, so the game still sees it
+			uint16_t keys = controls.keys | controls.taps.exchange( 0 ) ;
+			for (int key = 0; key < 16; key++)
+			{
+				uint16_t bit = 1 << key ;
+				if ((keys ^ held) & bit)
+				{
+					bool pressed = 0 != (keys & bit) ;
+					if (pressed)
+						cpu->KeyPressed( key ) ;
+					else
+						cpu->KeyReleased( key ) ;
+					if (recording)
+						recording->Record( *cpu, key, pressed ) ;
+				}
+			}
+			held = keys ;
+
+			if (controls.save.exchange( false ))
+				writer.Save( savePath, *cpu ) ;
+			if (controls.load.exchange( false ))
+			{
+				// a movie can only replay input from the state it started in
+				writer.Wait( ) ;
+				if (recording)
+					printf("Savestates cannot be loaded while recording a movie\n") ;
+				else if (!ReadSaveState( savePath, *cpu ))
+					printf("Could not load savestate %s\n", savePath.c_str()) ;
+			}
+
+			// while rewinding, step back one recorded frame instead of running one
+			if (controls.rewinding)
+			{
+				// the recording carries on from the frame rewound to
+				if (rewind.Pop( *cpu ) && recording)
+					recording->Truncate( *cpu ) ;
+			}
+			else
+			{
+				if (rewindSeconds > 0)
+					rewind.Push( *cpu ) ;
+				cpu->ExecuteOpcodes( FramePacer::GetBudget( cpu->GetInstructionCount( ), numopcodes, fps ) ) ;
+			}
+
+			// only frames where something was drawn or cleared are handed over
+			if (cpu->TakeDirtyRows( ))
+			{
+				DisplayFrame& frame = frames.GetBack( ) ;
+				memcpy( frame.display, cpu->GetDisplay( ), sizeof(frame.display) ) ;
+				frame.number = number ;
+				frames.Publish( ) ;
+			}
+			number++ ;
+
+			// asleep until the next frame is due, not spinning
+			pacer.Wait( ) ;
+		}
+	} ) ;
 
-	bool quit = false ;
-	SDL_Event event;	
-	float interval = 1000 ;
-	interval /= fps ;
+	SDL_Event event;
 
-	unsigned int time2 = SDL_GetTicks( ) ;
+	// the window has to be drawn again even if the display has not changed
+	bool exposed = true ;
+	// what the window shows, to find the rows a new frame changed
+	DisplayFrame shown ;
+	memset( &shown, 0, sizeof(shown) ) ;
 
-	while (!quit)
+	while (!controls.quit)
 	{
-		while( SDL_PollEvent( &event ) ) 
-		{ 
-			HandleInput( cpu, &event, quit) ;
-
-			if( event.type == SDL_QUIT ) 
-			{ 
-				quit = true; 
-			} 
+		while( SDL_PollEvent( &event ) )
+		{
+			HandleInput( &controls, &event, shown ) ;
+
+			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED)
+				exposed = true ;
+
+			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+			{
+				FitViewport( SDL_GL_GetCurrentWindow( ), &presenter ) ;
+				exposed = true ;
+			}
+
+			if( event.type == SDL_QUIT )
+			{
+				controls.quit = true;
+			}
 		}
 
-		unsigned int current = SDL_GetTicks( ) ;
+		// frames where nothing was drawn or cleared are not presented again,
+		// unless the last one is still fading out
+		uint32_t rows = 0 ;
+		if (frames.Take( ))
+		{
+			const DisplayFrame& frame = frames.GetFront( ) ;
+			for (int y = 0; y < DISPLAY_HEIGHT; y++)
+			{
+				if (frame.display[y] != shown.display[y])
+					rows |= 1u << y ;
+			}
+			shown = frame ;
+		}
 
-		if( (time2 + interval) < current )
+		if (exposed || rows || presenter.IsFading( ))
 		{
-			cpu->DecreaseTimers( ) ;
-			for (int i = 0 ; i < numframe; i++)
-				cpu->ExecuteNextOpcode( ) ;
+			Render_Frame( shown.display, rows, &presenter ) ;
+			exposed = false ;
+		}
+		else
+		{
+			// nothing new to show, wait for the next frame or event
+			SDL_Delay( 1 ) ;
+		}
+	}
+
+	emulation.join( ) ;
 
-			time2 = current ;
-			Render_Frame(cpu) ;
-		} 
+	if (recording)
+	{
+		recording->Finish( *cpu ) ;
+		if (recording->Save( moviePath ))
+			printf("Recorded %zu key events to %s\n", recording->GetEventCount(), moviePath.c_str()) ;
+		else
+			printf("Could not write movie %s\n", moviePath.c_str()) ;
 	}
 }
 
-void Render_Frame(Chip8* cpu)
+void Render_Frame(const uint64_t* display, uint32_t dirtyRows, Presenter* presenter)
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glLoadIdentity();
-	glRasterPos2i(-1, 1);
-	glPixelZoom(1, -1);
-	glDrawPixels(WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, cpu->m_ScreenData);
+    presenter->Upload(display, dirtyRows);
+    presenter->Draw();
 	SDL_GL_SwapWindow(SDL_GL_GetCurrentWindow()); ;
 	glFlush();
 }
@@ -279,7 +501,7 @@ bool CreateSDLWindow(SDL_Window** window, SDL_GLContext* glContext)
                                SDL_WINDOWPOS_CENTERED, // Center the window on the screen
                                SDL_WINDOWPOS_CENTERED,
                                WIDTH, HEIGHT,
-                               SDL_WINDOW_OPENGL);     // Enable OpenGL context for this window
+                               SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE); // OpenGL context, any size
     if (*window == nullptr)
     {
         std::cerr << "Window could not be created! SDL Error: " << SDL_GetError() << std::endl;
@@ -294,6 +516,9 @@ bool CreateSDLWindow(SDL_Window** window, SDL_GLContext* glContext)
         return false;
     }
 
+    // swaps wait for vertical blank, emulation runs on its own thread
+    SDL_GL_SetSwapInterval(1);
+
     // Initialize OpenGL settings
     if (!GL_INIT())
     {
@@ -318,8 +543,24 @@ bool LoadChip8Rom(Chip8* cpu, const SETTINGS_MAP& settings, std::string* romName
         return false ;
     }
 
+    // optional behaviour variant for the rom, see quirks.h
+    QuirkProfile quirks = QUIRKS_DEFAULT ;
+    SETTINGS_MAP::const_iterator quirksIt = settings.find("Quirks") ;
+    if (settings.end() != quirksIt && !Chip8::ParseQuirkProfile(quirksIt->second.c_str(), quirks))
+    {
+        printf("Unknown Quirks setting %s, using default\n", quirksIt->second.c_str()) ;
+        quirks = QUIRKS_DEFAULT ;
+    }
+
+    // optional seed for CXNN, otherwise every session plays differently
+    uint64_t seed = SDL_GetPerformanceCounter() ;
+    SETTINGS_MAP::const_iterator seedIt = settings.find("RandomSeed") ;
+    if (settings.end() != seedIt)
+        seed = strtoull( seedIt->second.c_str(), 0, 0 ) ;
+    cpu->SetRandomSeed( seed ) ;
+
     // load the rom file into memory
-    bool res = cpu->LoadRom( (*it).second ) ;
+    bool res = cpu->LoadRom( (*it).second, quirks ) ;
     romName->assign((*it).second) ;
     return res ;
 }
@@ -0,0 +1,175 @@
+#include "chip8.h"
+#include "lockstep.h"
+#include "pacer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Monte Carlo input search workload: LOCKSTEP_LANES copies of a ROM, each
+// holding its own random key for a few frames at a time. Runs them once on
+// the lockstep SIMD engine and once as separate Chip8 machines, then
+// compares the speed and the final state of every lane.
+//
+// usage: chip8-montecarlo <rom> [-f frames] [-s opcodes-per-second] [-q quirks] [-k hold-frames] [-S seed]
+
+static void PrintUsage(const char* exe)
+{
+    printf("usage: %s <rom> [-f frames] [-s opcodes-per-second] [-q quirks] [-k hold-frames] [-S seed]\n", exe);
+    printf("  -f  number of 60Hz frames to run (default 600)\n");
+    printf("  -s  opcodes executed per second of emulated time (default 700)\n");
+    printf("  -q  quirk profile: default, cosmac or superchip\n");
+    printf("  -k  frames each lane holds a random key for (default 10)\n");
+    printf("  -S  seed of the input sequences and of CXNN (default 1)\n");
+}
+
+// Key lane holds during a period, -1 for none. A hash rather than a
+// generator, so both engines see the same inputs without sharing state.
+static int LaneKey(uint64_t seed, int lane, long long period)
+{
+    uint64_t z = seed + lane * 0x9E3779B97F4A7C15ULL + period * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    int key = (int)(z % 20);
+    return key < 16 ? key : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::string romName = argv[1];
+    long long frames = 600;
+    int opcodesPerSecond = 700;
+    int hold = 10;
+    uint64_t seed = 1;
+    QuirkProfile quirks = QUIRKS_DEFAULT;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-f") && i + 1 < argc)
+            frames = atoll(argv[++i]);
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            opcodesPerSecond = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-k") && i + 1 < argc)
+            hold = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-S") && i + 1 < argc)
+            seed = strtoull(argv[++i], 0, 0);
+        else if (0 == strcmp(argv[i], "-q") && i + 1 < argc && Chip8::ParseQuirkProfile(argv[i + 1], quirks))
+            i++;
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (hold < 1)
+        hold = 1;
+
+    // about 130K of lane state, so keep it off the stack
+    std::unique_ptr<LockstepMachines> lanes(new LockstepMachines());
+    lanes->SetRandomSeed(seed);
+    lanes->SetOpcodesPerSecond(opcodesPerSecond);
+    if (!lanes->LoadRom(romName, quirks))
+    {
+        fprintf(stderr, "Failed to load Chip8 ROM %s\n", romName.c_str());
+        return 1;
+    }
+
+    int held[LOCKSTEP_LANES];
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        held[l] = -1;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long long frame = 0; frame < frames; frame++)
+    {
+        for (int l = 0; l < LOCKSTEP_LANES; l++)
+        {
+            int key = LaneKey(seed, l, frame / hold);
+            if (key == held[l])
+                continue;
+            if (held[l] >= 0)
+                lanes->KeyReleased(l, held[l]);
+            if (key >= 0)
+                lanes->KeyPressed(l, key);
+            held[l] = key;
+        }
+
+        lanes->ExecuteOpcodes(FramePacer::GetBudget(lanes->GetSteps(), opcodesPerSecond, 60));
+    }
+    double lockstepSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the same lanes as independent machines, one after the other
+    std::vector<Chip8> machines(LOCKSTEP_LANES);
+    start = std::chrono::steady_clock::now();
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+    {
+        Chip8& cpu = machines[l];
+        cpu.SetRandomSeed(seed);
+        cpu.SetOpcodesPerSecond(opcodesPerSecond);
+        // the lanes run every instruction of a wait loop, so the machines do too
+        cpu.EnableIdleSkip(false);
+        cpu.LoadRom(romName, quirks);
+
+        int key = -1;
+        for (long long frame = 0; frame < frames; frame++)
+        {
+            int next = LaneKey(seed, l, frame / hold);
+            if (next != key)
+            {
+                if (key >= 0)
+                    cpu.KeyReleased(key);
+                if (next >= 0)
+                    cpu.KeyPressed(next);
+                key = next;
+            }
+
+            cpu.ExecuteOpcodes(FramePacer::GetBudget(cpu.GetInstructionCount(), opcodesPerSecond, 60));
+        }
+    }
+    double scalarSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int matching = 0;
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+    {
+        const Chip8& cpu = machines[l];
+        bool same = cpu.GetAddressI() == lanes->GetAddressI(l) &&
+                    cpu.GetDelayTimer() == lanes->GetDelayTimer(l) &&
+                    cpu.GetSoundTimer() == lanes->GetSoundTimer(l) &&
+                    cpu.GetDisplayHash() == lanes->GetDisplayHash(l) &&
+                    machines[l].GetProgramCounter() == lanes->GetProgramCounter(l);
+        for (int i = 0; i < 16; i++)
+            same = same && cpu.GetRegisters()[i] == lanes->GetRegister(l, i);
+
+        if (same)
+            matching++;
+        else
+            printf("lane %d differs from its scalar machine\n", l);
+    }
+
+    long long instructions = lanes->GetSteps() * LOCKSTEP_LANES;
+    printf("rom:           %s\n", romName.c_str());
+    printf("quirks:        %s\n", Chip8::GetQuirkProfileName(quirks));
+    printf("lanes:         %d\n", LOCKSTEP_LANES);
+    printf("frames:        %lld\n", frames);
+    printf("instructions:  %lld across all lanes\n", instructions);
+    printf("lockstep:      %.6f s, %.0f instructions/s, %.2f groups per step\n", lockstepSeconds,
+           instructions / lockstepSeconds, lanes->GetSteps() ? (double)lanes->GetGroups() / lanes->GetSteps() : 0.0);
+    printf("scalar (%s): %.6f s, %.0f instructions/s\n", Chip8::GetDispatchEngine(), scalarSeconds,
+           instructions / scalarSeconds);
+    printf("speedup:       %.2fx\n", scalarSeconds / lockstepSeconds);
+    printf("matching:      %d/%d lanes\n", matching, LOCKSTEP_LANES);
+
+    return matching == LOCKSTEP_LANES ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#include "movie.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+const int MOVIE_VERSION = 1 ;
+
+Movie::Movie()
+    : m_Quirks(QUIRKS_DEFAULT)
+    , m_OpcodesPerSecond(0)
+    , m_RandomSeed(DEFAULT_RANDOM_SEED)
+    , m_EndInstruction(0)
+    , m_EndDisplayHash(0)
+{
+}
+
+void Movie::Start(const std::string& romName, QuirkProfile quirks, int opcodesPerSecond, uint64_t randomSeed)
+{
+    m_RomName = romName;
+    m_Quirks = quirks;
+    m_OpcodesPerSecond = opcodesPerSecond;
+    m_RandomSeed = randomSeed;
+    m_Events.clear();
+    m_EndInstruction = 0;
+    m_EndDisplayHash = 0;
+}
+
+void Movie::Record(const Chip8& cpu, int key, bool pressed)
+{
+    MovieEvent event = { cpu.GetInstructionCount(), (BYTE)key, pressed };
+    m_Events.push_back(event);
+}
+
+void Movie::Truncate(const Chip8& cpu)
+{
+    long long now = cpu.GetInstructionCount();
+    while (!m_Events.empty() && m_Events.back().instruction > now)
+        m_Events.pop_back();
+
+    // the keys the player holds now may not be the ones the kept events leave pressed
+    bool held[16] = {};
+    for (size_t i = 0; i < m_Events.size(); i++)
+        held[m_Events[i].key] = m_Events[i].pressed;
+    for (int key = 0; key < 16; key++)
+    {
+        if (held[key] != cpu.IsKeyPressed(key))
+            Record(cpu, key, !held[key]);
+    }
+}
+
+void Movie::Finish(const Chip8& cpu)
+{
+    m_EndInstruction = cpu.GetInstructionCount();
+    m_EndDisplayHash = cpu.GetDisplayHash();
+}
+
+bool Movie::Save(const std::string& filename) const
+{
+    FILE* out = fopen(filename.c_str(), "w");
+    if (0 == out)
+        return false;
+
+    fprintf(out, "chip8-movie %d\n", MOVIE_VERSION);
+    fprintf(out, "rom %s\n", m_RomName.c_str());
+    fprintf(out, "quirks %s\n", Chip8::GetQuirkProfileName(m_Quirks));
+    fprintf(out, "opcodes-per-second %d\n", m_OpcodesPerSecond);
+    fprintf(out, "seed %llu\n", (unsigned long long)m_RandomSeed);
+    for (size_t i = 0; i < m_Events.size(); i++)
+        fprintf(out, "key %lld %s %d\n", m_Events[i].instruction, m_Events[i].pressed ? "down" : "up", m_Events[i].key);
+    fprintf(out, "end %lld %016llx\n", m_EndInstruction, (unsigned long long)m_EndDisplayHash);
+
+    return 0 == fclose(out);
+}
+
+bool Movie::Load(const std::string& filename)
+{
+    std::ifstream in(filename.c_str());
+    if (!in)
+        return false;
+
+    std::string line;
+    int version = 0;
+    if (!std::getline(in, line) || 1 != sscanf(line.c_str(), "chip8-movie %d", &version) ||
+        version != MOVIE_VERSION)
+        return false;
+
+    Start("", QUIRKS_DEFAULT, 0, DEFAULT_RANDOM_SEED);
+    bool ended = false;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string tag;
+        if (!(fields >> tag))
+            continue;
+
+        if ("rom" == tag)
+        {
+            // the rest of the line, rom names can have spaces
+            m_RomName = line.substr(4);
+        }
+        else if ("quirks" == tag)
+        {
+            std::string name;
+            if (!(fields >> name) || !Chip8::ParseQuirkProfile(name.c_str(), m_Quirks))
+                return false;
+        }
+        else if ("opcodes-per-second" == tag)
+        {
+            if (!(fields >> m_OpcodesPerSecond) || m_OpcodesPerSecond < 1)
+                return false;
+        }
+        else if ("seed" == tag)
+        {
+            if (!(fields >> m_RandomSeed))
+                return false;
+        }
+        else if ("key" == tag)
+        {
+            MovieEvent event;
+            std::string direction;
+            int key = -1;
+            if (!(fields >> event.instruction >> direction >> key) || key < 0 || key > 15 ||
+                ("down" != direction && "up" != direction))
+                return false;
+
+            // events must not go back in time
+            if (!m_Events.empty() && event.instruction < m_Events.back().instruction)
+                return false;
+
+            event.key = (BYTE)key;
+            event.pressed = "down" == direction;
+            m_Events.push_back(event);
+        }
+        else if ("end" == tag)
+        {
+            fields >> m_EndInstruction >> std::hex >> m_EndDisplayHash;
+            ended = !fields.fail();
+        }
+        else
+            return false;
+    }
+
+    return ended && !m_RomName.empty() && m_OpcodesPerSecond > 0;
+}
+
+size_t Movie::Feed(Chip8& cpu, size_t next) const
+{
+    long long now = cpu.GetInstructionCount();
+    for (; next < m_Events.size() && m_Events[next].instruction <= now; next++)
+    {
+        if (m_Events[next].pressed)
+            cpu.KeyPressed(m_Events[next].key);
+        else
+            cpu.KeyReleased(m_Events[next].key);
+    }
+    return next;
+}
+
+const std::string& Movie::GetRomName() const
+{
+    return m_RomName;
+}
+
+QuirkProfile Movie::GetQuirkProfile() const
+{
+    return m_Quirks;
+}
+
+int Movie::GetOpcodesPerSecond() const
+{
+    return m_OpcodesPerSecond;
+}
+
+uint64_t Movie::GetRandomSeed() const
+{
+    return m_RandomSeed;
+}
+
+size_t Movie::GetEventCount() const
+{
+    return m_Events.size();
+}
+
+long long Movie::GetEndInstruction() const
+{
+    return m_EndInstruction;
+}
+
+uint64_t Movie::GetEndDisplayHash() const
+{
+    return m_EndDisplayHash;
+}
+
+bool IsMovieFile(const std::string& filename)
+{
+    size_t length = strlen(MOVIE_EXTENSION);
+    return filename.size() > length && 0 == filename.compare(filename.size() - length, length, MOVIE_EXTENSION);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "chip8.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+const char* const MOVIE_EXTENSION = ".c8m" ;
+
+bool IsMovieFile(const std::string& filename);
+
+// a key changing state, stamped with Chip8::GetInstructionCount() at the time
+struct MovieEvent
+{
+    long long instruction ;
+    BYTE key ;
+    bool pressed ;
+};
+
+// A recorded session: the rom it started from and every key transition.
+// Input only reaches the machine between ExecuteOpcodes calls, so feeding
+// the events back at the same instruction counts, with the same frame
+// budgets (see FramePacer::GetBudget) and random seed, reproduces the run
+// without a window or real-time pacing.
+//
+// Saved as text, one line per event, so a movie can be read and edited:
+//   chip8-movie 1
+//   rom roms/Pong.ch8
+//   quirks default
+//   opcodes-per-second 700
+//   seed 1
+//   key 2431 down 1
+//   end 66000 3a56b1b2e9a3e405
+class Movie
+{
+public:
+    Movie();
+
+    void Start(const std::string& romName, QuirkProfile quirks, int opcodesPerSecond, uint64_t randomSeed);
+    void Record(const Chip8& cpu, int key, bool pressed);
+    // drops the input after the machine's instruction count, e.g. after rewinding
+    void Truncate(const Chip8& cpu);
+    // notes where the recording stopped and what the screen showed
+    void Finish(const Chip8& cpu);
+
+    bool Save(const std::string& filename) const;
+    bool Load(const std::string& filename);
+
+    // applies the events due at the machine's instruction count, starting
+    // from event next, and returns the first event still to come
+    size_t Feed(Chip8& cpu, size_t next) const;
+
+    const std::string& GetRomName() const;
+    QuirkProfile GetQuirkProfile() const;
+    int GetOpcodesPerSecond() const;
+    uint64_t GetRandomSeed() const;
+    size_t GetEventCount() const;
+    long long GetEndInstruction() const;
+    uint64_t GetEndDisplayHash() const;
+
+private:
+    std::string m_RomName ;
+    QuirkProfile m_Quirks ;
+    int m_OpcodesPerSecond ;
+    uint64_t m_RandomSeed ;
+    std::vector<MovieEvent> m_Events ;
+    long long m_EndInstruction ;
+    uint64_t m_EndDisplayHash ;
+};
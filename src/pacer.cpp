@@ -0,0 +1,89 @@
+#include "pacer.h"
+
+#include <thread>
+
+// the part of a wait spent yielding rather than asleep, to cover the
+// scheduler waking the thread late
+static const std::chrono::microseconds SPIN_TIME(200) ;
+
+FramePacer::FramePacer(int framesPerSecond)
+    : m_FramesPerSecond(framesPerSecond > 0 ? framesPerSecond : 60)
+    , m_Frames(0)
+    , m_Restarts(0)
+    , m_TotalLateness(0)
+    , m_MaxLateness(0)
+{
+    Restart();
+}
+
+void FramePacer::Restart()
+{
+    m_Start = std::chrono::steady_clock::now();
+    m_Frame = 0;
+}
+
+std::chrono::steady_clock::time_point FramePacer::GetDeadline(long long frame) const
+{
+    // whole nanoseconds from the start, so the error never builds up
+    return m_Start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::nanoseconds(frame * 1000000000LL / m_FramesPerSecond));
+}
+
+void FramePacer::Wait()
+{
+    m_Frame++;
+    m_Frames++;
+    std::chrono::steady_clock::time_point deadline = GetDeadline(m_Frame);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (now > GetDeadline(m_Frame + MAX_LATE_FRAMES))
+    {
+        m_Restarts++;
+        Restart();
+        return;
+    }
+
+    if (deadline - now > SPIN_TIME)
+        std::this_thread::sleep_until(deadline - SPIN_TIME);
+    while ((now = std::chrono::steady_clock::now()) < deadline)
+        std::this_thread::yield();
+
+    double lateness = std::chrono::duration<double>(now - deadline).count();
+    m_TotalLateness += lateness;
+    if (lateness > m_MaxLateness)
+        m_MaxLateness = lateness;
+}
+
+long long FramePacer::GetFrameCount() const
+{
+    return m_Frames;
+}
+
+long long FramePacer::GetRestartCount() const
+{
+    return m_Restarts;
+}
+
+double FramePacer::GetMeanLateness() const
+{
+    return m_Frames > m_Restarts ? m_TotalLateness / (m_Frames - m_Restarts) : 0.0;
+}
+
+double FramePacer::GetMaxLateness() const
+{
+    return m_MaxLateness;
+}
+
+int FramePacer::GetBudget(long long instructionCount, int opcodesPerSecond, int framesPerSecond)
+{
+    if (opcodesPerSecond < 1 || framesPerSecond < 1)
+        return 1;
+    if (instructionCount < 0)
+        instructionCount = 0;
+
+    // the last frame boundary at or before the count is frame k, the
+    // largest k with k * opcodesPerSecond / framesPerSecond <= instructionCount
+    long long k = ((instructionCount + 1) * framesPerSecond + opcodesPerSecond - 1) / opcodesPerSecond - 1;
+    long long end = (k + 1) * opcodesPerSecond / framesPerSecond;
+    return end > instructionCount ? (int)(end - instructionCount) : 1;
+}
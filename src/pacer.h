@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+
+// Keeps a run at a fixed frame rate against the monotonic clock. Each
+// frame's deadline is worked out from the start of the run, not from the
+// previous frame, so rounding and late wake-ups never add up to drift.
+// Wait sleeps for most of the time left and yields for the last 200us,
+// about one percent of a core at 60Hz, to wake within a few microseconds.
+//
+// The instructions for a frame come from GetBudget, which spreads a rate
+// that is not a multiple of the frame rate over the frames exactly.
+class FramePacer
+{
+public:
+    explicit FramePacer(int framesPerSecond);
+
+    // sleeps until the next frame is due. A run that has fallen
+    // MAX_LATE_FRAMES behind, say after a stall in the debugger, starts
+    // a new timeline instead of running the missed frames back to back
+    void Wait();
+    // starts a new timeline from now
+    void Restart();
+
+    long long GetFrameCount() const;
+    long long GetRestartCount() const;
+    // how long after their deadlines frames started, in seconds
+    double GetMeanLateness() const;
+    double GetMaxLateness() const;
+
+    // instructions for the frame starting at instructionCount, so that after
+    // n frames from reset the machine has run opcodesPerSecond * n / fps of
+    // them, rounded down. Always at least one. It only depends on the
+    // machine's count, so rewind, savestates and replays stay on schedule
+    static int GetBudget(long long instructionCount, int opcodesPerSecond, int framesPerSecond);
+
+    static const int MAX_LATE_FRAMES = 5 ;
+
+private:
+    std::chrono::steady_clock::time_point GetDeadline(long long frame) const;
+
+    int m_FramesPerSecond ;
+    std::chrono::steady_clock::time_point m_Start ;
+    long long m_Frame ;        // of the current timeline
+    long long m_Frames ;       // waited for in all
+    long long m_Restarts ;
+    double m_TotalLateness ;
+    double m_MaxLateness ;
+};
@@ -0,0 +1,308 @@
+#include "chip8.h"
+#include "pacer.h"
+#include "presenter.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Presentation benchmark. Creates an offscreen OpenGL context through EGL,
+// which Mesa's llvmpipe provides on machines without a GPU, runs a ROM and
+// shows every frame with each Presenter strategy in turn. Reports the time
+// per frame spent uploading, drawing and swapping, and checks that every
+// strategy produced the same image. With -D frames where nothing was drawn
+// are skipped and only the rows that changed are uploaded, as the emulator
+// does.
+//
+// usage: chip8-present <rom> [-f frames] [-s opcodes-per-second] [-x scale] [-p strategy] [-D] [-o csv]
+
+static void PrintUsage(const char* exe)
+{
+    printf("usage: %s <rom> [-f frames] [-s opcodes-per-second] [-x scale] [-p strategy] [-D] [-o csv]\n", exe);
+    printf("  -f  frames shown per strategy (default 600)\n");
+    printf("  -s  opcodes executed per second of emulated time (default 700)\n");
+    printf("  -x  window pixels per display pixel (default 10)\n");
+    printf("  -p  only this strategy: drawpixels, drawpixels-zoom, texture-scaled, texture or shader\n");
+    printf("  -D  skip unchanged frames and upload only the rows that changed\n");
+    printf("  -o  also write the results as CSV to this file, - for stdout\n");
+}
+
+// frames left out of the timings while the driver warms up
+const int WARMUP_FRAMES = 10 ;
+
+struct PresentResult
+{
+    PresentStrategy strategy ;
+    int frames ;          // timed
+    int presented ;       // of the timed frames, the others were unchanged
+    uint64_t uploaded ;   // bytes handed to GL in the timed frames
+    double upload ;       // seconds over the timed frames
+    double draw ;
+    double swap ;
+    uint64_t imageHash ;  // of the last frame read back
+};
+
+// An EGL pbuffer of the window's size with a compatibility profile context.
+// Prefers Mesa's surfaceless platform, which needs no X or Wayland server.
+static bool CreateContext(int width, int height, EGLDisplay* display)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    *display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay)
+        *display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0);
+    if (EGL_NO_DISPLAY == *display)
+        *display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (EGL_NO_DISPLAY == *display || !eglInitialize(*display, &major, &minor))
+        return false;
+
+    const EGLint configAttributes[] =
+    {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    if (!eglChooseConfig(*display, configAttributes, &config, 1, &configs) || configs < 1)
+        return false;
+
+    const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    EGLSurface surface = eglCreatePbufferSurface(*display, config, surfaceAttributes);
+    if (EGL_NO_SURFACE == surface || !eglBindAPI(EGL_OPENGL_API))
+        return false;
+
+    EGLContext context = eglCreateContext(*display, config, EGL_NO_CONTEXT, 0);
+    return EGL_NO_CONTEXT != context && eglMakeCurrent(*display, surface, surface, context);
+}
+
+static double Elapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t HashImage(const std::vector<BYTE>& pixels)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        hash ^= pixels[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// The same ROM run from the start for every strategy, so each shows the same frames
+static bool RunStrategy(const std::string& romName, PresentStrategy strategy, bool dirtyOnly, int frames,
+                        int opcodesPerSecond, int width, int height, EGLDisplay display, PresentResult& result)
+{
+    Chip8 cpu;
+    if (!cpu.LoadRom(romName))
+        return false;
+    cpu.SetOpcodesPerSecond(opcodesPerSecond);
+
+    Presenter presenter(strategy, width, height);
+    memset(&result, 0, sizeof(result));
+    result.strategy = strategy;
+
+    EGLSurface surface = eglGetCurrentSurface(EGL_DRAW);
+    for (int frame = 0; frame < WARMUP_FRAMES + frames; frame++)
+    {
+        cpu.ExecuteOpcodes(FramePacer::GetBudget(cpu.GetInstructionCount(), opcodesPerSecond, 60));
+
+        bool timed = frame >= WARMUP_FRAMES;
+        if (timed)
+            result.frames++;
+
+        // an unchanged frame costs nothing, the window keeps showing the last one
+        uint32_t rows = cpu.TakeDirtyRows();
+        if (dirtyOnly && 0 == rows && !presenter.IsFading())
+            continue;
+
+        uint64_t uploaded = presenter.GetUploadedBytes();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        presenter.Upload(cpu.GetDisplay(), dirtyOnly ? rows : ALL_DISPLAY_ROWS);
+        double upload = Elapsed(start);
+
+        start = std::chrono::steady_clock::now();
+        presenter.Draw();
+        double draw = Elapsed(start);
+
+        // a software driver rasterises when the frame is flushed, so wait
+        // for it here as a swap to a window would
+        start = std::chrono::steady_clock::now();
+        eglSwapBuffers(display, surface);
+        glFinish();
+        double swap = Elapsed(start);
+
+        if (timed)
+        {
+            result.upload += upload;
+            result.draw += draw;
+            result.swap += swap;
+            result.presented++;
+            result.uploaded += presenter.GetUploadedBytes() - uploaded;
+        }
+    }
+
+    // a pbuffer swap keeps the back buffer, read the last frame back from it
+    std::vector<BYTE> pixels(width * height * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    result.imageHash = HashImage(pixels);
+
+    return GL_NO_ERROR == glGetError();
+}
+
+// A CSV field, quoted with its quotes doubled when it holds a comma or quote
+static std::string CsvField(const std::string& text)
+{
+    if (std::string::npos == text.find_first_of(",\""))
+        return text;
+
+    std::string field = "\"";
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if ('"' == text[i])
+            field += '"';
+        field += text[i];
+    }
+    return field + "\"";
+}
+
+static bool WriteCsv(FILE* out, const std::string& romName, int width, int height, const std::vector<PresentResult>& results)
+{
+    fprintf(out, "strategy,rom,width,height,frames,presented,uploaded_bytes,upload_us,draw_us,swap_us,total_us,image_hash\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const PresentResult& result = results[i];
+        double perFrame = 1e6 / result.frames;
+        // rom names can hold commas and quotes
+        std::string name = CsvField(romName);
+        fprintf(out, "%s,%s,%d,%d,%d,%d,%llu,%.3f,%.3f,%.3f,%.3f,%016llx\n", Presenter::GetStrategyName(result.strategy),
+                name.c_str(), width, height, result.frames, result.presented, (unsigned long long)result.uploaded,
+                result.upload * perFrame, result.draw * perFrame,
+                result.swap * perFrame, (result.upload + result.draw + result.swap) * perFrame,
+                (unsigned long long)result.imageHash);
+    }
+    return 0 == ferror(out);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::string romName = argv[1];
+    int frames = 600;
+    int opcodesPerSecond = 700;
+    int scale = 10;
+    int only = -1;
+    bool dirtyOnly = false;
+    std::string csvName;
+
+    for (int i = 2; i < argc; i++)
+    {
+        PresentStrategy strategy;
+        if (0 == strcmp(argv[i], "-f") && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            opcodesPerSecond = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-x") && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-p") && i + 1 < argc && Presenter::ParseStrategy(argv[i + 1], strategy))
+        {
+            only = strategy;
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "-D"))
+            dirtyOnly = true;
+        else if (0 == strcmp(argv[i], "-o") && i + 1 < argc)
+            csvName = argv[++i];
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (frames < 1 || scale < 1)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    int width = DISPLAY_WIDTH * scale;
+    int height = DISPLAY_HEIGHT * scale;
+    EGLDisplay display;
+    if (!CreateContext(width, height, &display))
+    {
+        fprintf(stderr, "Could not create an offscreen OpenGL context through EGL\n");
+        return 1;
+    }
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    printf("rom:           %s\n", romName.c_str());
+    printf("renderer:      %s, OpenGL %s\n", (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION));
+    printf("window:        %dx%d, %d frames per strategy%s\n", width, height, frames,
+           dirtyOnly ? ", unchanged frames skipped" : "");
+    printf("%-16s %10s %10s %10s %10s %9s %9s %10s  %s\n", "strategy", "upload us", "draw us", "swap us", "total us",
+           "fps", "presented", "KB/frame", "image");
+
+    std::vector<PresentResult> results;
+    for (int strategy = 0; strategy < PRESENT_STRATEGY_COUNT; strategy++)
+    {
+        if (only >= 0 && only != strategy)
+            continue;
+
+        PresentResult result;
+        if (!RunStrategy(romName, (PresentStrategy)strategy, dirtyOnly, frames, opcodesPerSecond, width, height, display, result))
+        {
+            fprintf(stderr, "Failed to run %s with strategy %s\n", romName.c_str(),
+                    Presenter::GetStrategyName((PresentStrategy)strategy));
+            return 1;
+        }
+
+        double perFrame = 1e6 / result.frames;
+        double total = (result.upload + result.draw + result.swap) * perFrame;
+        printf("%-16s %10.2f %10.2f %10.2f %10.2f %9.0f %9d %10.2f  %016llx%s\n",
+               Presenter::GetStrategyName(result.strategy), result.upload * perFrame, result.draw * perFrame,
+               result.swap * perFrame, total, total > 0 ? 1e6 / total : 0.0, result.presented,
+               result.uploaded / 1024.0 / result.frames, (unsigned long long)result.imageHash,
+               !results.empty() && results[0].imageHash != result.imageHash ? " differs" : "");
+        results.push_back(result);
+    }
+
+    bool same = true;
+    for (size_t i = 1; i < results.size(); i++)
+        same = same && results[i].imageHash == results[0].imageHash;
+
+    if (!csvName.empty())
+    {
+        FILE* out = "-" == csvName ? stdout : fopen(csvName.c_str(), "w");
+        bool written = 0 != out && WriteCsv(out, romName, width, height, results);
+        if (out && stdout != out)
+            written = 0 == fclose(out) && written;
+        if (!written)
+        {
+            fprintf(stderr, "Failed to write %s\n", csvName.c_str());
+            return 1;
+        }
+    }
+
+    return same ? 0 : 1;
+}
@@ -0,0 +1,388 @@
+#include "presenter.h"
+#include "chip8.h"
+
+// the OpenGL 2.0 shader entry points are exported by libGL on Linux
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <cstdio>
+#include <cstring>
+
+static const char* const s_StrategyNames[PRESENT_STRATEGY_COUNT] =
+{
+    "drawpixels", "drawpixels-zoom", "texture-scaled", "texture", "shader"
+};
+
+// GLSL 1.10, the version every OpenGL 2.0 compatibility context has
+static const char* const s_VertexShader =
+    "varying vec2 v_Coord;\n"
+    "void main()\n"
+    "{\n"
+    "    v_Coord = gl_MultiTexCoord0.xy;\n"
+    "    gl_Position = gl_Vertex;\n"
+    "}\n";
+
+// Each texel holds 8 pixels, the leftmost in the top bit. Nearest scaling
+// falls out of picking the bit under the fragment
+static const char* const s_FragmentShader =
+    "uniform sampler2D u_Display;\n"
+    "uniform sampler2D u_Previous;\n"
+    "uniform vec3 u_Off;\n"
+    "uniform vec3 u_On;\n"
+    "uniform float u_Scanlines;\n"
+    "uniform float u_Phosphor;\n"
+    "varying vec2 v_Coord;\n"
+    "float Pixel(sampler2D display)\n"
+    "{\n"
+    "    float bits = floor(texture2D(display, v_Coord).r * 255.0 + 0.5);\n"
+    "    float shift = 7.0 - mod(floor(v_Coord.x * 64.0), 8.0);\n"
+    "    return mod(floor(bits / exp2(shift)), 2.0);\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    float lit = max(Pixel(u_Display), u_Phosphor * Pixel(u_Previous));\n"
+    "    float shade = 1.0 - u_Scanlines * step(0.7, fract(v_Coord.y * 32.0));\n"
+    "    gl_FragColor = vec4(mix(u_Off, u_On, lit) * shade, 1.0);\n"
+    "}\n";
+
+static GLuint CompileShader(GLenum type, const char* source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, 0);
+    glCompileShader(shader);
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (GL_TRUE == compiled)
+        return shader;
+
+    char log[512] = "";
+    glGetShaderInfoLog(shader, sizeof(log), 0, log);
+    fprintf(stderr, "Could not compile the display shader: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+}
+
+static void SetColour(float* colour, uint32_t rgb)
+{
+    colour[0] = ((rgb >> 16) & 0xFF) / 255.0f;
+    colour[1] = ((rgb >> 8) & 0xFF) / 255.0f;
+    colour[2] = (rgb & 0xFF) / 255.0f;
+}
+
+// the first row of the image is the top of the screen
+static void DrawQuad()
+{
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(-1, 1);
+    glTexCoord2f(0, 1); glVertex2f(-1, -1);
+    glTexCoord2f(1, 1); glVertex2f(1, -1);
+    glTexCoord2f(1, 0); glVertex2f(1, 1);
+    glEnd();
+}
+
+static GLuint CreateTexture()
+{
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    return texture;
+}
+
+Presenter::Presenter(PresentStrategy strategy, int width, int height)
+    : m_Strategy(strategy)
+    , m_Width(width)
+    , m_Height(height)
+    , m_Texture(0)
+    , m_PreviousTexture(0)
+    , m_Program(0)
+    , m_Stale(true)
+    , m_Scanlines(0)
+    , m_Phosphor(0)
+    , m_UploadedBytes(0)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (PRESENT_SHADER == strategy && !CreateProgram())
+    {
+        printf("Shaders are not available, presenting with %s\n", GetStrategyName(PRESENT_TEXTURE));
+        m_Strategy = PRESENT_TEXTURE;
+    }
+
+    if (PRESENT_TEXTURE_SCALED == m_Strategy || PRESENT_TEXTURE == m_Strategy || PRESENT_SHADER == m_Strategy)
+        m_Texture = CreateTexture();
+    if (PRESENT_SHADER == m_Strategy)
+        m_PreviousTexture = CreateTexture();
+
+    Allocate();
+    SetPalette(0xFFFFFF, 0x000000);
+    SetEffects(0, 0);
+}
+
+Presenter::~Presenter()
+{
+    if (m_Texture)
+        glDeleteTextures(1, &m_Texture);
+    if (m_PreviousTexture)
+        glDeleteTextures(1, &m_PreviousTexture);
+    if (m_Program)
+        glDeleteProgram(m_Program);
+}
+
+bool Presenter::CreateProgram()
+{
+    // OpenGL 1.x has no shading language, and no entry points for it
+    const GLubyte* version = glGetString(GL_SHADING_LANGUAGE_VERSION);
+    if (0 == version)
+    {
+        glGetError();
+        return false;
+    }
+
+    GLuint vertex = CompileShader(GL_VERTEX_SHADER, s_VertexShader);
+    GLuint fragment = CompileShader(GL_FRAGMENT_SHADER, s_FragmentShader);
+    if (0 == vertex || 0 == fragment)
+    {
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+        return false;
+    }
+
+    m_Program = glCreateProgram();
+    glAttachShader(m_Program, vertex);
+    glAttachShader(m_Program, fragment);
+    glLinkProgram(m_Program);
+    // the program keeps them for as long as it needs them
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(m_Program, GL_LINK_STATUS, &linked);
+    if (GL_TRUE != linked)
+    {
+        glDeleteProgram(m_Program);
+        m_Program = 0;
+        return false;
+    }
+
+    glUseProgram(m_Program);
+    glUniform1i(glGetUniformLocation(m_Program, "u_Display"), 0);
+    glUniform1i(glGetUniformLocation(m_Program, "u_Previous"), 1);
+    glUseProgram(0);
+    return true;
+}
+
+// Sizes the image for the strategy and the area drawn to, and gives the
+// textures storage for it
+void Presenter::Allocate()
+{
+    if (PRESENT_SHADER == m_Strategy)
+    {
+        // a byte per 8 pixels
+        m_ImageWidth = DISPLAY_WIDTH / 8;
+        m_ImageHeight = DISPLAY_HEIGHT;
+        m_Channels = 1;
+    }
+    else
+    {
+        // the CPU scaled strategies scale by whole pixels
+        bool scaled = PRESENT_DRAWPIXELS == m_Strategy || PRESENT_TEXTURE_SCALED == m_Strategy;
+        int scaleX = scaled && m_Width >= DISPLAY_WIDTH ? m_Width / DISPLAY_WIDTH : 1;
+        int scaleY = scaled && m_Height >= DISPLAY_HEIGHT ? m_Height / DISPLAY_HEIGHT : 1;
+        m_ImageWidth = DISPLAY_WIDTH * scaleX;
+        m_ImageHeight = DISPLAY_HEIGHT * scaleY;
+        m_Channels = scaled ? 3 : 1;
+    }
+    m_Pixels.assign(m_ImageWidth * m_ImageHeight * m_Channels, 0);
+    m_Previous = m_Pixels;
+    m_Stale = true;
+
+    GLenum format = 3 == m_Channels ? GL_RGB : GL_LUMINANCE;
+    GLuint textures[] = { m_Texture, m_PreviousTexture };
+    for (size_t i = 0; i < sizeof(textures) / sizeof(textures[0]); i++)
+    {
+        if (0 == textures[i])
+            continue;
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, m_ImageWidth, m_ImageHeight, 0, format, GL_UNSIGNED_BYTE, &m_Pixels[0]);
+    }
+}
+
+void Presenter::Resize(int width, int height)
+{
+    if (width == m_Width && height == m_Height)
+        return;
+    m_Width = width;
+    m_Height = height;
+    Allocate();
+}
+
+void Presenter::SetPalette(uint32_t off, uint32_t on)
+{
+    SetColour(m_Off, off);
+    SetColour(m_On, on);
+    if (0 == m_Program)
+        return;
+    glUseProgram(m_Program);
+    glUniform3fv(glGetUniformLocation(m_Program, "u_Off"), 1, m_Off);
+    glUniform3fv(glGetUniformLocation(m_Program, "u_On"), 1, m_On);
+    glUseProgram(0);
+}
+
+void Presenter::SetEffects(float scanlines, float phosphor)
+{
+    m_Scanlines = scanlines < 0 ? 0 : scanlines > 1 ? 1 : scanlines;
+    m_Phosphor = phosphor < 0 ? 0 : phosphor > 1 ? 1 : phosphor;
+    if (0 == m_Program)
+        return;
+    glUseProgram(m_Program);
+    glUniform1f(glGetUniformLocation(m_Program, "u_Scanlines"), m_Scanlines);
+    glUniform1f(glGetUniformLocation(m_Program, "u_Phosphor"), m_Phosphor);
+    glUseProgram(0);
+}
+
+bool Presenter::IsFading() const
+{
+    return m_Phosphor > 0 && m_Previous != m_Pixels;
+}
+
+// Set pixels are black on white, as the display has always been shown
+void Presenter::Upload(const uint64_t* display, uint32_t dirtyRows)
+{
+    if (m_Stale)
+    {
+        dirtyRows = ALL_DISPLAY_ROWS;
+        m_Stale = false;
+    }
+
+    size_t pitch = m_ImageWidth * m_Channels;
+    if (PRESENT_SHADER == m_Strategy)
+    {
+        // the frame being replaced is what phosphor keeps showing
+        if (m_Phosphor > 0)
+        {
+            m_Previous = m_Pixels;
+            glBindTexture(GL_TEXTURE_2D, m_PreviousTexture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_ImageWidth, m_ImageHeight, GL_LUMINANCE, GL_UNSIGNED_BYTE, &m_Previous[0]);
+            m_UploadedBytes += m_Previous.size();
+        }
+
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            if (dirtyRows & (1u << y))
+            {
+                for (int i = 0; i < m_ImageWidth; i++)
+                    m_Pixels[y * pitch + i] = (BYTE)(display[y] >> (56 - 8 * i));
+            }
+        }
+    }
+    else
+    {
+        int scaleX = m_ImageWidth / DISPLAY_WIDTH;
+        int scaleY = m_ImageHeight / DISPLAY_HEIGHT;
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            if (0 == (dirtyRows & (1u << y)))
+                continue;
+
+            BYTE* line = &m_Pixels[y * scaleY * pitch];
+            for (int x = 0; x < DISPLAY_WIDTH; x++)
+            {
+                BYTE colour = (display[y] >> (DISPLAY_WIDTH - 1 - x)) & 1 ? 0 : 255;
+                memset(line + x * scaleX * m_Channels, colour, scaleX * m_Channels);
+            }
+
+            // the remaining lines of the scaled row are copies of the first
+            for (int i = 1; i < scaleY; i++)
+                memcpy(line + i * pitch, line, pitch);
+        }
+    }
+
+    if (0 == m_Texture)
+        return;
+
+    // one update per run of dirty rows
+    int scaleY = m_ImageHeight / DISPLAY_HEIGHT;
+    glBindTexture(GL_TEXTURE_2D, m_Texture);
+    for (int y = 0; y < DISPLAY_HEIGHT; )
+    {
+        if (0 == (dirtyRows & (1u << y)))
+        {
+            y++;
+            continue;
+        }
+
+        int first = y;
+        while (y < DISPLAY_HEIGHT && (dirtyRows & (1u << y)))
+            y++;
+
+        int lines = (y - first) * scaleY;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first * scaleY, m_ImageWidth, lines,
+                        3 == m_Channels ? GL_RGB : GL_LUMINANCE, GL_UNSIGNED_BYTE, &m_Pixels[first * scaleY * pitch]);
+        m_UploadedBytes += lines * pitch;
+    }
+}
+
+void Presenter::Draw()
+{
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glLoadIdentity();
+
+    if (0 == m_Texture)
+    {
+        // texturing would apply to the pixel rectangle too
+        glDisable(GL_TEXTURE_2D);
+        glRasterPos2i(-1, 1);
+        glPixelZoom((float)m_Width / m_ImageWidth, -(float)m_Height / m_ImageHeight);
+        glDrawPixels(m_ImageWidth, m_ImageHeight, 3 == m_Channels ? GL_RGB : GL_LUMINANCE, GL_UNSIGNED_BYTE, &m_Pixels[0]);
+        m_UploadedBytes += m_Pixels.size();
+        return;
+    }
+
+    if (m_Program)
+    {
+        glUseProgram(m_Program);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, m_PreviousTexture);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_Texture);
+        DrawQuad();
+        glUseProgram(0);
+        return;
+    }
+
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, m_Texture);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    DrawQuad();
+}
+
+uint64_t Presenter::GetUploadedBytes() const
+{
+    return m_UploadedBytes;
+}
+
+PresentStrategy Presenter::GetStrategy() const
+{
+    return m_Strategy;
+}
+
+const char* Presenter::GetStrategyName(PresentStrategy strategy)
+{
+    return strategy < PRESENT_STRATEGY_COUNT ? s_StrategyNames[strategy] : "unknown";
+}
+
+bool Presenter::ParseStrategy(const char* name, PresentStrategy& strategy)
+{
+    for (int i = 0; i < PRESENT_STRATEGY_COUNT; i++)
+    {
+        if (0 == strcmp(name, s_StrategyNames[i]))
+        {
+            strategy = (PresentStrategy)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "instruction.h"
+
+#include <stdint.h>
+#include <vector>
+
+// Ways of putting the 64x32 display on screen with OpenGL
+enum PresentStrategy
+{
+    PRESENT_DRAWPIXELS,      // scale to the window on the CPU, glDrawPixels, the original path
+    PRESENT_DRAWPIXELS_ZOOM, // glDrawPixels of the 64x32 image, scaled by glPixelZoom
+    PRESENT_TEXTURE_SCALED,  // scale on the CPU, upload to a window-sized texture, draw a quad
+    PRESENT_TEXTURE,         // upload the 64x32 image to a texture, scale it with a nearest-filtered quad
+    PRESENT_SHADER,          // upload the display's bits, a fragment shader scales and colours them
+    PRESENT_STRATEGY_COUNT
+};
+
+// Draws the display into the current GL context with one strategy.
+// Upload turns the display into pixels and hands them to GL, Draw clears
+// and draws them; swapping is left to the window system. Needs a
+// compatibility context, and must be created with that context current.
+// Upload only converts the rows in dirtyRows (see Chip8::TakeDirtyRows),
+// and the texture strategies only send those rows to GL.
+//
+// The shader strategy keeps the display as an 8x32 texture of packed bits,
+// 256 bytes in all, and needs OpenGL 2.0. Where that is missing it falls
+// back to the texture strategy, so check GetStrategy after construction.
+// The palette and effects only apply to the shader strategy.
+class Presenter
+{
+public:
+    Presenter(PresentStrategy strategy, int width, int height);
+    ~Presenter();
+    Presenter(const Presenter&) = delete;
+    Presenter& operator=(const Presenter&) = delete;
+
+    void Upload(const uint64_t* display, uint32_t dirtyRows);
+    void Draw();
+
+    // the area drawn to changed size, the next Upload converts every row
+    void Resize(int width, int height);
+
+    // 0xRRGGBB colours of clear and set pixels, white and black by default
+    void SetPalette(uint32_t off, uint32_t on);
+    // scanlines darkens the lower part of each display row, 0 to 1.
+    // phosphor keeps that share of the previous frame's set pixels lit
+    void SetEffects(float scanlines, float phosphor);
+    // the previous frame still shows through, so the next one should be
+    // presented even when nothing has been drawn
+    bool IsFading() const;
+
+    // pixel data handed to GL so far
+    uint64_t GetUploadedBytes() const;
+
+    PresentStrategy GetStrategy() const;
+    static const char* GetStrategyName(PresentStrategy strategy);
+    static bool ParseStrategy(const char* name, PresentStrategy& strategy);
+
+private:
+    void Allocate();
+    bool CreateProgram();
+
+    PresentStrategy m_Strategy ;
+    int m_Width ;          // of the area drawn to
+    int m_Height ;
+    int m_ImageWidth ;     // of m_Pixels: the display, the scaled image or the packed bits
+    int m_ImageHeight ;
+    int m_Channels ;       // 3 for RGB, 1 for luminance
+    std::vector<BYTE> m_Pixels ;
+    std::vector<BYTE> m_Previous ; // the shader's last frame, for phosphor
+    unsigned int m_Texture ; // 0 for the glDrawPixels strategies
+    unsigned int m_PreviousTexture ;
+    unsigned int m_Program ; // 0 unless the shader strategy
+    bool m_Stale ;         // every row has to be converted again
+    float m_Off[3] ;
+    float m_On[3] ;
+    float m_Scanlines ;
+    float m_Phosphor ;
+    uint64_t m_UploadedBytes ;
+};
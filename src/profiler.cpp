@@ -0,0 +1,237 @@
+#include "profiler.h"
+#include "chip8.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+ExecutionProfile::ExecutionProfile()
+{
+    Clear();
+}
+
+void ExecutionProfile::Clear()
+{
+    memset(m_Handlers, 0, sizeof(m_Handlers));
+    memset(m_Instructions, 0, sizeof(m_Instructions));
+    memset(m_Reads, 0, sizeof(m_Reads));
+    memset(m_Writes, 0, sizeof(m_Writes));
+}
+
+uint64_t ExecutionProfile::GetHandlerCount(BYTE handler) const
+{
+    return handler < OP_COUNT ? m_Handlers[handler] : 0;
+}
+
+uint64_t ExecutionProfile::GetInstructionCount(WORD address) const
+{
+    return m_Instructions[address & 0xFFF];
+}
+
+uint64_t ExecutionProfile::GetReadCount(WORD address) const
+{
+    return m_Reads[address & 0xFFF];
+}
+
+uint64_t ExecutionProfile::GetWriteCount(WORD address) const
+{
+    return m_Writes[address & 0xFFF];
+}
+
+uint64_t ExecutionProfile::GetTotal() const
+{
+    uint64_t total = 0;
+    for (int i = 0; i < OP_COUNT; i++)
+        total += m_Handlers[i];
+    return total;
+}
+
+static double Share(uint64_t count, uint64_t total)
+{
+    return total ? 100.0 * count / total : 0.0;
+}
+
+// indices of the non-zero counts, most first
+static std::vector<int> Hottest(const uint64_t* counts, int size, int top)
+{
+    std::vector<int> order;
+    for (int i = 0; i < size; i++)
+    {
+        if (counts[i])
+            order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [counts](int a, int b) { return counts[a] > counts[b]; });
+    if ((int)order.size() > top)
+        order.resize(top);
+    return order;
+}
+
+void ExecutionProfile::PrintSummary(FILE* out, int top) const
+{
+    uint64_t total = GetTotal();
+    fprintf(out, "hottest opcodes:\n");
+    std::vector<int> handlers = Hottest(m_Handlers, OP_COUNT, top);
+    for (size_t i = 0; i < handlers.size(); i++)
+        fprintf(out, "  %-16s %14llu %6.2f%%\n", Chip8::GetOpcodeName(handlers[i]),
+                (unsigned long long)m_Handlers[handlers[i]], Share(m_Handlers[handlers[i]], total));
+
+    fprintf(out, "hottest addresses:\n");
+    std::vector<int> addresses = Hottest(m_Instructions, 0x1000, top);
+    for (size_t i = 0; i < addresses.size(); i++)
+        fprintf(out, "  %03X              %14llu %6.2f%%\n", addresses[i],
+                (unsigned long long)m_Instructions[addresses[i]], Share(m_Instructions[addresses[i]], total));
+}
+
+bool ExecutionProfile::WriteHandlerCsv(FILE* out) const
+{
+    uint64_t total = GetTotal();
+    fprintf(out, "handler,count,share\n");
+    for (int i = 0; i < OP_COUNT; i++)
+        fprintf(out, "%s,%llu,%.4f\n", Chip8::GetOpcodeName(i), (unsigned long long)m_Handlers[i], Share(m_Handlers[i], total));
+    return 0 == ferror(out);
+}
+
+bool ExecutionProfile::WriteInstructionCsv(FILE* out) const
+{
+    uint64_t total = GetTotal();
+    fprintf(out, "address,count,share\n");
+    for (int i = 0; i < 0x1000; i++)
+    {
+        if (m_Instructions[i])
+            fprintf(out, "0x%03X,%llu,%.4f\n", i, (unsigned long long)m_Instructions[i], Share(m_Instructions[i], total));
+    }
+    return 0 == ferror(out);
+}
+
+bool ExecutionProfile::WriteMemoryCsv(FILE* out) const
+{
+    fprintf(out, "address,reads,writes\n");
+    for (int i = 0; i < 0x1000; i++)
+    {
+        if (m_Reads[i] || m_Writes[i])
+            fprintf(out, "0x%03X,%llu,%llu\n", i, (unsigned long long)m_Reads[i], (unsigned long long)m_Writes[i]);
+    }
+    return 0 == ferror(out);
+}
+
+// the non-zero entries of counts as a JSON object keyed by hex address
+static void WriteJsonAddresses(FILE* out, const char* name, const uint64_t* counts)
+{
+    fprintf(out, "  \"%s\": {", name);
+    const char* separator = "";
+    for (int i = 0; i < 0x1000; i++)
+    {
+        if (counts[i])
+        {
+            fprintf(out, "%s\"0x%03X\": %llu", separator, i, (unsigned long long)counts[i]);
+            separator = ", ";
+        }
+    }
+    fprintf(out, "}");
+}
+
+bool ExecutionProfile::WriteJson(FILE* out) const
+{
+    fprintf(out, "{\n  \"total\": %llu,\n  \"handlers\": {", (unsigned long long)GetTotal());
+    for (int i = 0; i < OP_COUNT; i++)
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", Chip8::GetOpcodeName(i), (unsigned long long)m_Handlers[i]);
+    fprintf(out, "},\n");
+    WriteJsonAddresses(out, "instructions", m_Instructions);
+    fprintf(out, ",\n");
+    WriteJsonAddresses(out, "reads", m_Reads);
+    fprintf(out, ",\n");
+    WriteJsonAddresses(out, "writes", m_Writes);
+    fprintf(out, "\n}\n");
+    return 0 == ferror(out);
+}
+
+bool ExecutionProfile::WriteListing(FILE* out, const BYTE* memory) const
+{
+    // up to the last byte that is set, run or accessed
+    int end = 0x200;
+    for (int i = 0x200; i < 0x1000; i++)
+    {
+        if (memory[i] || m_Instructions[i] || m_Reads[i] || m_Writes[i])
+            end = i + 1;
+    }
+
+    uint64_t total = GetTotal();
+    fprintf(out, "; %llu instructions\n", (unsigned long long)total);
+    fprintf(out, "; addr  opcode  handler         count   share      reads     writes\n");
+    for (int address = 0x200; address < end; )
+    {
+        // a byte on its own where an instruction starts at the next address
+        int width = 0 == m_Instructions[address] && address + 1 < 0x1000 && m_Instructions[address + 1] ? 1 : 2;
+        if (address + width > 0x1000)
+            width = 1;
+
+        uint64_t reads = 0, writes = 0;
+        for (int i = 0; i < width; i++)
+        {
+            reads += m_Reads[address + i];
+            writes += m_Writes[address + i];
+        }
+
+        std::string counts;
+        char buffer[64];
+        if (m_Instructions[address])
+        {
+            snprintf(buffer, sizeof(buffer), "%14llu %6.2f%%", (unsigned long long)m_Instructions[address],
+                     Share(m_Instructions[address], total));
+            counts = buffer;
+        }
+
+        if (reads || writes)
+        {
+            snprintf(buffer, sizeof(buffer), " %10llu %10llu", (unsigned long long)reads, (unsigned long long)writes);
+            counts.resize(22, ' ');
+            counts += buffer;
+        }
+
+        char line[128];
+        if (1 == width)
+            snprintf(line, sizeof(line), "  %03X   %02X      data    %s", address, memory[address], counts.c_str());
+        else
+        {
+            // only words that ran are named, the others may well be data
+            WORD opcode = memory[address] << 8 | memory[address + 1];
+            const char* name = m_Instructions[address] ? Chip8::GetOpcodeName(Chip8::DecodeInstruction(opcode).handler) : "";
+            snprintf(line, sizeof(line), "  %03X   %04X    %-8s%s", address, opcode, name, counts.c_str());
+        }
+
+        size_t length = strlen(line);
+        while (length > 0 && ' ' == line[length - 1])
+            length--;
+        fprintf(out, "%.*s\n", (int)length, line);
+        address += width;
+    }
+    return 0 == ferror(out);
+}
+
+static bool WriteFile(const std::string& filename, const ExecutionProfile& profile,
+                      bool (ExecutionProfile::*write)(FILE*) const)
+{
+    FILE* out = fopen(filename.c_str(), "w");
+    if (0 == out)
+        return false;
+    bool written = (profile.*write)(out);
+    return 0 == fclose(out) && written;
+}
+
+bool ExecutionProfile::WriteFiles(const char* prefix, const BYTE* memory) const
+{
+    std::string base = prefix;
+    bool written = WriteFile(base + ".json", *this, &ExecutionProfile::WriteJson) &&
+                   WriteFile(base + "-opcodes.csv", *this, &ExecutionProfile::WriteHandlerCsv) &&
+                   WriteFile(base + "-pcs.csv", *this, &ExecutionProfile::WriteInstructionCsv) &&
+                   WriteFile(base + "-memory.csv", *this, &ExecutionProfile::WriteMemoryCsv);
+    if (!written)
+        return false;
+
+    FILE* out = fopen((base + ".lst").c_str(), "w");
+    if (0 == out)
+        return false;
+    written = WriteListing(out, memory);
+    return 0 == fclose(out) && written;
+}
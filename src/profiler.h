@@ -0,0 +1,64 @@
+#pragma once
+#include "instruction.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Execution counts gathered by a Chip8 built with -DCHIP8_PROFILE: runs
+// of each opcode handler, runs of the instruction at each address, and
+// data reads and writes of each byte of memory. Opcode fetches are not
+// counted as reads, the address counts already show where code runs.
+// Without the flag the counting compiles out and Chip8 has no profile.
+//
+// The BLOCK engine counts a superinstruction once, under its own handler
+// and the address it starts at. The JIT is not available while profiling.
+class ExecutionProfile
+{
+public:
+    ExecutionProfile();
+
+    void Clear();
+
+    void CountInstruction(WORD address, BYTE handler)
+    {
+        m_Handlers[handler]++;
+        m_Instructions[address & 0xFFF]++;
+    }
+    void CountReads(WORD address, int length)
+    {
+        for (int i = 0; i < length; i++)
+            m_Reads[(address + i) & 0xFFF]++;
+    }
+    void CountWrites(WORD address, int length)
+    {
+        for (int i = 0; i < length; i++)
+            m_Writes[(address + i) & 0xFFF]++;
+    }
+
+    uint64_t GetHandlerCount(BYTE handler) const;
+    uint64_t GetInstructionCount(WORD address) const;
+    uint64_t GetReadCount(WORD address) const;
+    uint64_t GetWriteCount(WORD address) const;
+    uint64_t GetTotal() const;
+
+    // prints the hottest handlers and addresses
+    void PrintSummary(FILE* out, int top) const;
+
+    // one row per handler, per executed address, and per accessed byte
+    bool WriteHandlerCsv(FILE* out) const;
+    bool WriteInstructionCsv(FILE* out) const;
+    bool WriteMemoryCsv(FILE* out) const;
+    // everything in one object
+    bool WriteJson(FILE* out) const;
+    // memory from 0x200 as instructions, each with its count and share of the run
+    bool WriteListing(FILE* out, const BYTE* memory) const;
+
+    // writes prefix.json, prefix-opcodes.csv, prefix-pcs.csv, prefix-memory.csv and prefix.lst
+    bool WriteFiles(const char* prefix, const BYTE* memory) const;
+
+private:
+    uint64_t m_Handlers[OP_COUNT] ;
+    uint64_t m_Instructions[0x1000] ;
+    uint64_t m_Reads[0x1000] ;
+    uint64_t m_Writes[0x1000] ;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+// Behaviour variants between CHIP-8 interpreters. Each profile is a policy
+// of compile-time constants; the quirk-dependent opcode handlers are
+// templates instantiated once per profile, so the choice costs no branch
+// when an opcode runs. A ROM picks its profile when it is loaded.
+enum QuirkProfile
+{
+    QUIRKS_DEFAULT,   // this emulator's original behaviour
+    QUIRKS_COSMAC,    // the COSMAC VIP interpreter
+    QUIRKS_SUPERCHIP, // SUPER-CHIP 1.1 on the HP48
+    QUIRK_PROFILE_COUNT
+};
+
+// shifts Vx in place, FX55/FX65 advance I, BNNN adds V0, sprites wrap
+struct DefaultQuirks
+{
+    static constexpr bool SHIFT_READS_VY = false ;   // 8XY6/8XYE shift Vy into Vx
+    static constexpr bool LOAD_STORE_ADVANCES_I = true ; // FX55/FX65 leave I past the last register
+    static constexpr bool JUMP_ADDS_VX = false ;     // BNNN jumps to XNN + Vx instead of NNN + V0
+    static constexpr bool CLIP_SPRITES = false ;     // DXYN drops pixels past the edges instead of wrapping
+};
+
+struct CosmacQuirks
+{
+    static constexpr bool SHIFT_READS_VY = true ;
+    static constexpr bool LOAD_STORE_ADVANCES_I = true ;
+    static constexpr bool JUMP_ADDS_VX = false ;
+    static constexpr bool CLIP_SPRITES = true ;
+};
+
+struct SuperChipQuirks
+{
+    static constexpr bool SHIFT_READS_VY = false ;
+    static constexpr bool LOAD_STORE_ADVANCES_I = false ;
+    static constexpr bool JUMP_ADDS_VX = true ;
+    static constexpr bool CLIP_SPRITES = true ;
+};
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+#include "instruction.h"
+
+// CXNN's random numbers. Every machine owns an xorshift64* generator so a
+// run depends only on its seed, and the lockstep engine, which keeps one
+// generator per lane, draws the same sequence as a scalar machine.
+const uint64_t DEFAULT_RANDOM_SEED = 1 ;
+
+// generator state for a seed, spread out with splitmix64 so nearby seeds
+// give unrelated sequences; xorshift must never be in the all-zero state
+inline uint64_t SeedRandom(uint64_t seed)
+{
+    uint64_t state = seed + 0x9E3779B97F4A7C15ULL;
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+    state ^= state >> 31;
+    return state ? state : 0x9E3779B97F4A7C15ULL;
+}
+
+// advances the generator and returns the high byte, the best mixed one
+inline BYTE NextRandom(uint64_t& state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (BYTE)((state * 0x2545F4914F6CDD1DULL) >> 56);
+}
@@ -0,0 +1,243 @@
+#include "chip8.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// Ahead-of-time recompiler: walks a ROM from 0x200, follows jumps, calls
+// and skips to find reachable code, and writes a C++ file with one
+// function per block plus the AotProgram table the AOT runner links.
+//
+// usage: chip8-recompile <rom> <output.cpp>
+
+const int PROGRAM_START = 0x200 ;
+const int MEMORY_SIZE = 0x1000 ;
+
+struct RecompiledBlock
+{
+    WORD start ;
+    std::vector<WORD> opcodes ;
+};
+
+static WORD ReadOpcode(const std::vector<BYTE>& memory, int address)
+{
+    WORD opcode = memory[address] << 8 ;
+    if (address + 1 < MEMORY_SIZE)
+        opcode |= memory[address + 1] ;
+    return opcode ;
+}
+
+static void AddTarget(std::vector<WORD>& worklist, int address, int romEnd)
+{
+    if (address >= PROGRAM_START && address < romEnd)
+        worklist.push_back(address) ;
+}
+
+// Decodes the block at start and queues every address it can continue at.
+// Computed jumps (BNNN) and returns (00EE) end a path, the runtime
+// interprets whatever they reach if it was not discovered elsewhere.
+static RecompiledBlock DiscoverBlock(const std::vector<BYTE>& memory, WORD start, int romEnd, std::vector<WORD>& worklist)
+{
+    RecompiledBlock block ;
+    block.start = start ;
+
+    int pc = start ;
+    while (pc < romEnd)
+    {
+        WORD opcode = ReadOpcode(memory, pc) ;
+        Instruction ins = Chip8::DecodeInstruction(opcode) ;
+        block.opcodes.push_back(opcode) ;
+        pc += 2 ;
+
+        if (!BlockCache::EndsBlock(ins.handler))
+            continue ;
+
+        switch (ins.handler)
+        {
+            case OP_1NNN:
+                AddTarget(worklist, ins.nnn, romEnd) ;
+                break ;
+            case OP_2NNN:
+                AddTarget(worklist, ins.nnn, romEnd) ;
+                AddTarget(worklist, pc, romEnd) ;
+                break ;
+            case OP_3XNN:
+            case OP_4XNN:
+            case OP_5XY0:
+            case OP_9XY0:
+            case OP_EX9E:
+            case OP_EXA1:
+                AddTarget(worklist, pc, romEnd) ;
+                AddTarget(worklist, pc + 2, romEnd) ;
+                break ;
+            case OP_FX0A:
+                AddTarget(worklist, pc - 2, romEnd) ;
+                AddTarget(worklist, pc, romEnd) ;
+                break ;
+            case OP_FX33:
+            case OP_FX55:
+                AddTarget(worklist, pc, romEnd) ;
+                break ;
+            default:
+                break ;
+        }
+        break ;
+    }
+
+    return block ;
+}
+
+// Writes the C++ statements for one instruction. Register arithmetic, I
+// updates, jumps and register skips are translated; everything else goes
+// through the interpreter's handler so behaviour stays identical.
+static void EmitInstruction(FILE* out, WORD opcode, WORD next)
+{
+    Instruction ins = Chip8::DecodeInstruction(opcode) ;
+    int x = ins.x ;
+    int y = ins.y ;
+
+    fprintf(out, "    // %04X\n", opcode) ;
+    switch (ins.handler)
+    {
+        case OP_NONE: break ;
+        case OP_1NNN: fprintf(out, "    PC = 0x%03X; return;\n", ins.nnn) ; break ;
+        case OP_3XNN: fprintf(out, "    PC = V[0x%X] == 0x%02X ? 0x%03X : 0x%03X; return;\n", x, ins.nn, next + 2, next) ; break ;
+        case OP_4XNN: fprintf(out, "    PC = V[0x%X] != 0x%02X ? 0x%03X : 0x%03X; return;\n", x, ins.nn, next + 2, next) ; break ;
+        case OP_5XY0: fprintf(out, "    PC = V[0x%X] == V[0x%X] ? 0x%03X : 0x%03X; return;\n", x, y, next + 2, next) ; break ;
+        case OP_9XY0: fprintf(out, "    PC = V[0x%X] != V[0x%X] ? 0x%03X : 0x%03X; return;\n", x, y, next + 2, next) ; break ;
+        case OP_6XNN: fprintf(out, "    V[0x%X] = 0x%02X;\n", x, ins.nn) ; break ;
+        case OP_7XNN: fprintf(out, "    V[0x%X] += 0x%02X;\n", x, ins.nn) ; break ;
+        case OP_8XY0: fprintf(out, "    V[0x%X] = V[0x%X];\n", x, y) ; break ;
+        case OP_8XY1: fprintf(out, "    V[0x%X] |= V[0x%X];\n", x, y) ; break ;
+        case OP_8XY2: fprintf(out, "    V[0x%X] &= V[0x%X];\n", x, y) ; break ;
+        case OP_8XY3: fprintf(out, "    V[0x%X] ^= V[0x%X];\n", x, y) ; break ;
+        case OP_8XY4:
+            fprintf(out, "    V[0xF] = 0; if (V[0x%X] + V[0x%X] > 255) V[0xF] = 1; V[0x%X] += V[0x%X];\n", x, y, x, y) ;
+            break ;
+        case OP_8XY5:
+            fprintf(out, "    V[0xF] = 1; if (V[0x%X] < V[0x%X]) V[0xF] = 0; V[0x%X] -= V[0x%X];\n", x, y, x, y) ;
+            break ;
+        case OP_8XY7:
+            fprintf(out, "    V[0xF] = 1; if (V[0x%X] < V[0x%X]) V[0xF] = 0; V[0x%X] = V[0x%X] - V[0x%X];\n", y, x, x, y, x) ;
+            break ;
+        case OP_ANNN: fprintf(out, "    I = 0x%03X;\n", ins.nnn) ; break ;
+        case OP_FX1E: fprintf(out, "    I += V[0x%X];\n", x) ; break ;
+        case OP_FX29: fprintf(out, "    I = V[0x%X] * 5;\n", x) ; break ;
+        default:
+            fprintf(out, "    PC = 0x%03X; AotRuntime::ExecuteOpcode(cpu, 0x%04X);\n", next, opcode) ;
+            if (BlockCache::EndsBlock(ins.handler))
+                fprintf(out, "    return;\n") ;
+            break ;
+    }
+}
+
+static void EmitProgram(FILE* out, const std::string& romName, const std::map<WORD, RecompiledBlock>& blocks)
+{
+    fprintf(out, "// Generated by chip8-recompile from %s, do not edit\n", romName.c_str()) ;
+    fprintf(out, "#include \"aot.h\"\n\n") ;
+
+    std::map<WORD, RecompiledBlock>::const_iterator it ;
+    for (it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        const RecompiledBlock& block = it->second ;
+
+        fprintf(out, "static const BYTE s_Code_%03X[] = {", block.start) ;
+        for (size_t i = 0; i < block.opcodes.size(); i++)
+            fprintf(out, "%s0x%02X, 0x%02X", i ? ", " : " ", block.opcodes[i] >> 8, block.opcodes[i] & 0xFF) ;
+        fprintf(out, " };\n\n") ;
+
+        // runs instructions [first, last) so a slice can enter or leave the block partway
+        fprintf(out, "static void Block_%03X(Chip8& cpu, int first, int last)\n{\n", block.start) ;
+        fprintf(out, "    BYTE* V = AotRuntime::Registers(cpu);\n") ;
+        fprintf(out, "    WORD& I = AotRuntime::AddressI(cpu);\n") ;
+        fprintf(out, "    WORD& PC = AotRuntime::ProgramCounter(cpu);\n") ;
+        fprintf(out, "    (void)V; (void)I; (void)last;\n\n") ;
+        fprintf(out, "    switch (first)\n    {\n") ;
+
+        WORD next = block.start ;
+        for (size_t i = 0; i < block.opcodes.size(); i++)
+        {
+            if (i > 0)
+                fprintf(out, "    case %d: if (%d == last) { PC = 0x%03X; return; }\n", (int)i, (int)i, next) ;
+            else
+                fprintf(out, "    case 0:\n") ;
+            next += 2 ;
+            EmitInstruction(out, block.opcodes[i], next) ;
+        }
+        fprintf(out, "    }\n    PC = 0x%03X;\n}\n\n", next) ;
+    }
+
+    fprintf(out, "static const AotBlock s_Blocks[] =\n{\n") ;
+    for (it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        const RecompiledBlock& block = it->second ;
+        fprintf(out, "    { 0x%03X, %d, s_Code_%03X, Block_%03X },\n",
+                block.start, (int)block.opcodes.size(), block.start, block.start) ;
+    }
+    fprintf(out, "};\n\n") ;
+
+    fprintf(out, "const AotProgram& GetAotProgram()\n{\n") ;
+    fprintf(out, "    static const AotProgram program = { \"%s\", s_Blocks, %d };\n", romName.c_str(), (int)blocks.size()) ;
+    fprintf(out, "    return program;\n}\n") ;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        printf("usage: %s <rom> <output.cpp>\n", argv[0]) ;
+        return 1 ;
+    }
+
+    FILE* in = fopen(argv[1], "rb") ;
+    if (0 == in)
+    {
+        fprintf(stderr, "Failed to open ROM %s\n", argv[1]) ;
+        return 1 ;
+    }
+
+    std::vector<BYTE> memory(MEMORY_SIZE, 0) ;
+    size_t romSize = fread(&memory[PROGRAM_START], 1, MEMORY_SIZE - PROGRAM_START, in) ;
+    fclose(in) ;
+
+    int romEnd = PROGRAM_START + (int)romSize ;
+
+    std::map<WORD, RecompiledBlock> blocks ;
+    std::vector<WORD> worklist ;
+    worklist.push_back(PROGRAM_START) ;
+
+    while (!worklist.empty())
+    {
+        WORD start = worklist.back() ;
+        worklist.pop_back() ;
+
+        if (blocks.count(start))
+            continue ;
+
+        blocks[start] = DiscoverBlock(memory, start, romEnd, worklist) ;
+    }
+
+    FILE* out = fopen(argv[2], "w") ;
+    if (0 == out)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", argv[2]) ;
+        return 1 ;
+    }
+
+    // escape the name for the string literal in the generated file
+    std::string romName ;
+    for (const char* c = argv[1]; *c; c++)
+    {
+        if ('"' == *c || '\\' == *c)
+            romName += '\\' ;
+        romName += *c ;
+    }
+
+    EmitProgram(out, romName, blocks) ;
+    fclose(out) ;
+
+    printf("%s: %d blocks recompiled to %s\n", argv[1], (int)blocks.size(), argv[2]) ;
+    return 0 ;
+}
@@ -0,0 +1,174 @@
+#include "rewind.h"
+
+#include <cstring>
+
+// keyframes are encoded against a machine that is all zeros
+static const Chip8State s_Empty = {};
+
+// equal bytes needed to end a literal run, shorter gaps are cheaper to copy
+const int MIN_SKIP = 4 ;
+
+static void PutVarint(std::vector<BYTE>& out, size_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((BYTE)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((BYTE)value);
+}
+
+static size_t GetVarint(const BYTE* in, size_t& pos)
+{
+    size_t value = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        BYTE byte = in[pos++];
+        value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+}
+
+RewindBuffer::RewindBuffer(int capacity, int keyframeInterval)
+    : m_Capacity(capacity > 1 ? capacity : 1)
+    , m_KeyframeInterval(keyframeInterval > 1 ? keyframeInterval : 1)
+    , m_FrameCount(0)
+{
+    memset(&m_Keyframe, 0, sizeof(m_Keyframe));
+    memset(&m_Scratch, 0, sizeof(m_Scratch));
+}
+
+// Appends the bytes of state that differ from base as a list of
+// (equal bytes to skip, literal count, literals XOR base) runs.
+// Equal bytes at the end are left out.
+void RewindBuffer::Encode(const BYTE* state, const BYTE* base, std::vector<BYTE>& out)
+{
+    const size_t size = sizeof(Chip8State);
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t start = i;
+        while (i < size && state[i] == base[i])
+            i++;
+        if (i == size)
+            break;
+
+        size_t literal = i;
+        int same = 0;
+        while (i < size && same < MIN_SKIP)
+        {
+            same = state[i] == base[i] ? same + 1 : 0;
+            i++;
+        }
+        i -= same;
+
+        PutVarint(out, literal - start);
+        PutVarint(out, i - literal);
+        for (size_t j = literal; j < i; j++)
+            out.push_back(state[j] ^ base[j]);
+    }
+}
+
+void RewindBuffer::Decode(const BYTE* in, size_t length, const BYTE* base, BYTE* state)
+{
+    memcpy(state, base, sizeof(Chip8State));
+
+    size_t pos = 0;
+    size_t address = 0;
+    while (pos < length)
+    {
+        address += GetVarint(in, pos);
+        size_t count = GetVarint(in, pos);
+        for (size_t j = 0; j < count; j++, address++)
+            state[address] = base[address] ^ in[pos++];
+    }
+}
+
+void RewindBuffer::Push(const Chip8& cpu)
+{
+    cpu.SaveState(m_Scratch);
+    const BYTE* scratch = reinterpret_cast<const BYTE*>(&m_Scratch);
+
+    if (m_Segments.empty() || (int)m_Segments.back().ends.size() >= m_KeyframeInterval)
+    {
+        // the finished segment will not grow again
+        if (!m_Segments.empty())
+        {
+            m_Segments.back().deltas.shrink_to_fit();
+            m_Segments.back().ends.shrink_to_fit();
+        }
+
+        m_Segments.push_back(Segment());
+        Encode(scratch, reinterpret_cast<const BYTE*>(&s_Empty), m_Segments.back().keyframe);
+        m_Segments.back().keyframe.shrink_to_fit();
+        m_Segments.back().ends.push_back(0);
+        m_Keyframe = m_Scratch;
+    }
+    else
+    {
+        Segment& segment = m_Segments.back();
+        Encode(scratch, reinterpret_cast<const BYTE*>(&m_Keyframe), segment.deltas);
+        segment.ends.push_back((uint32_t)segment.deltas.size());
+    }
+    m_FrameCount++;
+
+    // whole segments go, as long as the rest still covers the capacity
+    while (m_Segments.size() > 1 && m_FrameCount - (int)m_Segments.front().ends.size() >= m_Capacity)
+    {
+        m_FrameCount -= (int)m_Segments.front().ends.size();
+        m_Segments.pop_front();
+    }
+}
+
+bool RewindBuffer::Pop(Chip8& cpu)
+{
+    if (m_Segments.empty())
+        return false;
+
+    Segment& segment = m_Segments.back();
+    size_t begin = segment.ends.size() > 1 ? segment.ends[segment.ends.size() - 2] : 0;
+    Decode(segment.deltas.data() + begin, segment.ends.back() - begin,
+           reinterpret_cast<const BYTE*>(&m_Keyframe), reinterpret_cast<BYTE*>(&m_Scratch));
+    cpu.LoadState(m_Scratch);
+
+    segment.deltas.resize(begin);
+    segment.ends.pop_back();
+    m_FrameCount--;
+
+    if (segment.ends.empty())
+    {
+        m_Segments.pop_back();
+        if (!m_Segments.empty())
+        {
+            const Segment& previous = m_Segments.back();
+            Decode(previous.keyframe.data(), previous.keyframe.size(),
+                   reinterpret_cast<const BYTE*>(&s_Empty), reinterpret_cast<BYTE*>(&m_Keyframe));
+        }
+    }
+    return true;
+}
+
+void RewindBuffer::Clear()
+{
+    m_Segments.clear();
+    m_FrameCount = 0;
+}
+
+int RewindBuffer::GetFrameCount() const
+{
+    return m_FrameCount;
+}
+
+// bytes held by the history, including unused vector capacity
+size_t RewindBuffer::GetMemoryUsage() const
+{
+    size_t bytes = sizeof(*this);
+    for (size_t i = 0; i < m_Segments.size(); i++)
+    {
+        const Segment& segment = m_Segments[i];
+        bytes += sizeof(Segment) + segment.keyframe.capacity() + segment.deltas.capacity() +
+                 segment.ends.capacity() * sizeof(uint32_t);
+    }
+    return bytes;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "chip8.h"
+
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// History of a machine, one state per frame, for stepping back in time.
+// Every keyframeInterval frames a full state is kept, and the frames after
+// it are stored as the run-length encoded XOR against that keyframe. Most
+// of a state is memory that never changes, so a frame usually costs a few
+// dozen bytes, and any frame can be rebuilt from its keyframe alone.
+class RewindBuffer
+{
+public:
+    // keeps at least capacity frames, dropping the oldest keyframe's frames beyond that
+    RewindBuffer(int capacity = 60 * 60, int keyframeInterval = 60);
+
+    void Push(const Chip8& cpu);
+    // restores the newest frame into cpu and drops it, false when the history is empty
+    bool Pop(Chip8& cpu);
+    void Clear();
+
+    int GetFrameCount() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    // a keyframe and the frames that follow it
+    struct Segment
+    {
+        std::vector<BYTE> keyframe ;  // the full state, encoded against zeros
+        std::vector<BYTE> deltas ;    // every frame's encoding back to back
+        std::vector<uint32_t> ends ;  // end of each frame in deltas, the first frame is the keyframe
+    };
+
+    static void Encode(const BYTE* state, const BYTE* base, std::vector<BYTE>& out);
+    static void Decode(const BYTE* in, size_t length, const BYTE* base, BYTE* state);
+
+    std::deque<Segment> m_Segments ;
+    Chip8State m_Keyframe ;   // decoded keyframe of the newest segment
+    Chip8State m_Scratch ;
+    int m_Capacity ;
+    int m_KeyframeInterval ;
+    int m_FrameCount ;
+};
@@ -0,0 +1,187 @@
+#include "savestate.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SAVESTATE_MAGIC[4] = { 'C', '8', 'S', 'S' };
+
+// keeps the state in a mapped file 8-byte aligned
+static_assert(sizeof(SaveStateHeader) % 8 == 0, "savestate header must keep the state aligned");
+
+// FNV-1a over 64-bit words, then the tail bytes. A state is only a few
+// KB, so this costs about a microsecond and catches torn or edited files.
+uint64_t SaveStateChecksum(const void* data, size_t size)
+{
+    const BYTE* bytes = static_cast<const BYTE*>(data);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+bool IsSaveStateFile(const std::string& filename)
+{
+    size_t length = strlen(SAVESTATE_EXTENSION);
+    return filename.size() > length && 0 == filename.compare(filename.size() - length, length, SAVESTATE_EXTENSION);
+}
+
+void CaptureSaveState(const Chip8& cpu, SaveStateImage& image)
+{
+    memset(&image.header, 0, sizeof(image.header));
+    memcpy(image.header.magic, SAVESTATE_MAGIC, sizeof(SAVESTATE_MAGIC));
+    image.header.version = SAVESTATE_VERSION;
+    image.header.headerSize = sizeof(SaveStateHeader);
+    image.header.stateSize = sizeof(Chip8State);
+    image.header.quirks = (BYTE)cpu.GetQuirkProfile();
+
+    cpu.SaveState(image.state);
+    image.header.checksum = SaveStateChecksum(&image.state, sizeof(image.state));
+}
+
+// Written to a temporary file first, so a crash mid-write never leaves a torn savestate behind
+bool WriteSaveState(const std::string& filename, const SaveStateImage& image)
+{
+    std::string temporary = filename + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (0 == out)
+        return false;
+
+    bool written = 1 == fwrite(&image, sizeof(image), 1, out);
+    written = 0 == fclose(out) && written;
+    if (!written || 0 != rename(temporary.c_str(), filename.c_str()))
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool WriteSaveState(const std::string& filename, const Chip8& cpu)
+{
+    SaveStateImage image;
+    CaptureSaveState(cpu, image);
+    return WriteSaveState(filename, image);
+}
+
+// Maps the file and restores straight from the mapping, no copy into a buffer first
+bool ReadSaveState(const std::string& filename, Chip8& cpu)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (0 != fstat(fd, &info) || info.st_size < (off_t)sizeof(SaveStateHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mapping)
+        return false;
+
+    const SaveStateHeader* header = static_cast<const SaveStateHeader*>(mapping);
+    bool valid = 0 == memcmp(header->magic, SAVESTATE_MAGIC, sizeof(SAVESTATE_MAGIC)) &&
+                 SAVESTATE_VERSION == header->version &&
+                 sizeof(SaveStateHeader) == header->headerSize &&
+                 sizeof(Chip8State) == header->stateSize &&
+                 size >= sizeof(SaveStateImage) &&
+                 header->quirks < QUIRK_PROFILE_COUNT;
+
+    // the header is 8-byte aligned in size, so the state in the mapping is too
+    const Chip8State* state = reinterpret_cast<const Chip8State*>(static_cast<const BYTE*>(mapping) + sizeof(SaveStateHeader));
+    if (valid && header->checksum == SaveStateChecksum(state, sizeof(Chip8State)))
+    {
+        cpu.SetQuirkProfile(static_cast<QuirkProfile>(header->quirks));
+        cpu.LoadState(*state);
+    }
+    else
+        valid = false;
+
+    munmap(mapping, size);
+    return valid;
+}
+
+SaveStateWriter::SaveStateWriter()
+    : m_Writing(false)
+    , m_Stopping(false)
+    , m_Failed(0)
+{
+    m_Thread = std::thread(&SaveStateWriter::WriterLoop, this);
+}
+
+SaveStateWriter::~SaveStateWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_Wake.notify_one();
+    m_Thread.join();
+}
+
+void SaveStateWriter::Save(const std::string& filename, const Chip8& cpu)
+{
+    Pending pending;
+    pending.filename = filename;
+    CaptureSaveState(cpu, pending.image);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Queue.push_back(pending);
+    }
+    m_Wake.notify_one();
+}
+
+void SaveStateWriter::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Idle.wait(lock, [this] { return m_Queue.empty() && !m_Writing; });
+}
+
+int SaveStateWriter::GetFailedCount()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Failed;
+}
+
+void SaveStateWriter::WriterLoop()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;)
+    {
+        m_Wake.wait(lock, [this] { return m_Stopping || !m_Queue.empty(); });
+        if (m_Queue.empty())
+            return;
+
+        Pending pending = m_Queue.front();
+        m_Queue.pop_front();
+        m_Writing = true;
+
+        // the disk is only touched outside the lock
+        lock.unlock();
+        bool written = WriteSaveState(pending.filename, pending.image);
+        lock.lock();
+
+        if (!written)
+            m_Failed++;
+        m_Writing = false;
+        if (m_Queue.empty())
+            m_Idle.notify_all();
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "chip8.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+// Savestate files are a SaveStateHeader followed by the Chip8State bytes,
+// in the host's byte order. A file is only loaded when its magic, version
+// and state size match this build and its checksum is intact.
+const uint16_t SAVESTATE_VERSION = 1 ;
+const char* const SAVESTATE_EXTENSION = ".c8s" ;
+
+struct SaveStateHeader
+{
+    char magic[4] ;       // "C8SS"
+    uint16_t version ;    // SAVESTATE_VERSION when written
+    uint16_t headerSize ;
+    uint32_t stateSize ;  // bytes of Chip8State that follow the header
+    BYTE quirks ;         // QuirkProfile the machine ran with
+    BYTE reserved[3] ;
+    uint64_t checksum ;   // of the state bytes, see SaveStateChecksum
+};
+
+// a whole savestate file, as written
+struct SaveStateImage
+{
+    SaveStateHeader header ;
+    Chip8State state ;
+};
+
+void CaptureSaveState(const Chip8& cpu, SaveStateImage& image);
+bool WriteSaveState(const std::string& filename, const SaveStateImage& image);
+bool WriteSaveState(const std::string& filename, const Chip8& cpu);
+bool ReadSaveState(const std::string& filename, Chip8& cpu);
+bool IsSaveStateFile(const std::string& filename);
+uint64_t SaveStateChecksum(const void* data, size_t size);
+
+// Writes savestates on a background thread. Save only copies the state,
+// so the emulation loop never waits on the disk.
+class SaveStateWriter
+{
+public:
+    SaveStateWriter();
+    // finishes the queued writes first
+    ~SaveStateWriter();
+
+    void Save(const std::string& filename, const Chip8& cpu);
+    // blocks until every queued state is on disk
+    void Wait();
+    int GetFailedCount();
+
+private:
+    struct Pending
+    {
+        std::string filename ;
+        SaveStateImage image ;
+    };
+
+    void WriterLoop();
+
+    std::deque<Pending> m_Queue ;
+    std::mutex m_Mutex ;
+    std::condition_variable m_Wake ;
+    std::condition_variable m_Idle ;
+    bool m_Writing ;
+    bool m_Stopping ;
+    int m_Failed ;
+    std::thread m_Thread ;
+};
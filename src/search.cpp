@@ -0,0 +1,175 @@
+#include "chip8.h"
+#include "pacer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Breadth-first search over key inputs. Every step each state forks into
+// one child per key plus one with no key held, runs a few frames, and
+// children whose state hash has been seen before are pruned. Reports the
+// cost of forking and hashing and the nodes searched per second.
+//
+// usage: chip8-search <rom> [-d depth] [-f frames-per-step] [-b beam] [-s opcodes-per-second] [-q quirks]
+
+static void PrintUsage(const char* exe)
+{
+    printf("usage: %s <rom> [-d depth] [-f frames-per-step] [-b beam] [-s opcodes-per-second] [-q quirks]\n", exe);
+    printf("  -d  number of input steps to search (default 6)\n");
+    printf("  -f  60Hz frames each input is held for (default 4)\n");
+    printf("  -b  most states kept per step (default 4096)\n");
+    printf("  -s  opcodes executed per second of emulated time (default 700)\n");
+    printf("  -q  quirk profile: default, cosmac or superchip\n");
+}
+
+// inputs per state: the 16 keys, then no key
+const int INPUTS = 17 ;
+
+static double Elapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::string romName = argv[1];
+    int depth = 6;
+    int framesPerStep = 4;
+    size_t beam = 4096;
+    int opcodesPerSecond = 700;
+    QuirkProfile quirks = QUIRKS_DEFAULT;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-d") && i + 1 < argc)
+            depth = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-f") && i + 1 < argc)
+            framesPerStep = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-b") && i + 1 < argc)
+            beam = (size_t)atoll(argv[++i]);
+        else if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            opcodesPerSecond = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "-q") && i + 1 < argc && Chip8::ParseQuirkProfile(argv[i + 1], quirks))
+            i++;
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (depth < 1 || framesPerStep < 1 || beam < 1)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    Chip8 root;
+    if (!root.LoadRom(romName, quirks))
+    {
+        fprintf(stderr, "Failed to load Chip8 ROM %s\n", romName.c_str());
+        return 1;
+    }
+    root.SetOpcodesPerSecond(opcodesPerSecond);
+
+    // cost of the fork primitives on their own
+    const int REPEAT = 100000;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT / 10; i++)
+        root.Clone();
+    double cloneSeconds = Elapsed(start) / (REPEAT / 10);
+
+    Chip8 scratch;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; i++)
+        scratch.CopyStateFrom(root);
+    double copySeconds = Elapsed(start) / REPEAT;
+
+    // kept so the loop is not optimised away
+    volatile uint64_t sink = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; i++)
+        sink += root.GetStateHash();
+    double hashSeconds = Elapsed(start) / REPEAT;
+
+    printf("rom:           %s\n", romName.c_str());
+    printf("clone:         %.1f ns (new machine)\n", cloneSeconds * 1e9);
+    printf("copy state:    %.1f ns (into an existing machine)\n", copySeconds * 1e9);
+    printf("state hash:    %.1f ns\n", hashSeconds * 1e9);
+
+    // two pools of machines reused across steps, so their decoded blocks are too
+    std::vector<Chip8> current;
+    std::vector<Chip8> next;
+    current.push_back(root.Clone());
+    size_t currentSize = 1;
+
+    std::unordered_set<uint64_t> seen;
+    seen.insert(root.GetStateHash());
+
+    long long nodes = 0;
+    long long duplicates = 0;
+    double forkSeconds = 0;
+    start = std::chrono::steady_clock::now();
+
+    printf("%6s %10s %10s %12s\n", "step", "states", "children", "duplicates");
+    for (int step = 1; step <= depth && currentSize > 0; step++)
+    {
+        size_t nextSize = 0;
+        long long stepDuplicates = 0;
+        long long children = 0;
+
+        for (size_t n = 0; n < currentSize && nextSize < beam; n++)
+        {
+            for (int input = 0; input < INPUTS && nextSize < beam; input++)
+            {
+                if (nextSize == next.size())
+                    next.push_back(Chip8());
+                Chip8& child = next[nextSize];
+
+                std::chrono::steady_clock::time_point fork = std::chrono::steady_clock::now();
+                child.CopyStateFrom(current[n]);
+                forkSeconds += Elapsed(fork);
+
+                for (int key = 0; key < 16; key++)
+                {
+                    if (key == input)
+                        child.KeyPressed(key);
+                    else
+                        child.KeyReleased(key);
+                }
+                for (int frame = 0; frame < framesPerStep; frame++)
+                    child.ExecuteOpcodes(FramePacer::GetBudget(child.GetInstructionCount(), opcodesPerSecond, 60));
+                children++;
+
+                // a duplicate leaves its slot to the next child
+                if (seen.insert(child.GetStateHash()).second)
+                    nextSize++;
+                else
+                    stepDuplicates++;
+            }
+        }
+
+        printf("%6d %10zu %10lld %12lld\n", step, nextSize, children, stepDuplicates);
+        nodes += children;
+        duplicates += stepDuplicates;
+        current.swap(next);
+        currentSize = nextSize;
+    }
+
+    double seconds = Elapsed(start);
+    printf("nodes:         %lld searched, %lld duplicates pruned, %zu unique states\n", nodes, duplicates, seen.size());
+    printf("elapsed:       %.6f s, %.0f nodes/s, %.1f%% of it forking\n", seconds, nodes / seconds,
+           100.0 * forkSeconds / seconds);
+
+    return 0;
+}
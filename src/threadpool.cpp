@@ -0,0 +1,127 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threads)
+    : m_Queued(0)
+    , m_Pending(0)
+    , m_Steals(0)
+    , m_NextQueue(0)
+    , m_Stopping(false)
+{
+    if (threads < 1)
+        threads = 1;
+
+    for (int i = 0; i < threads; i++)
+        m_Queues.push_back(std::unique_ptr<Queue>(new Queue()));
+
+    for (int i = 0; i < threads; i++)
+        m_Workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_Stopping = true;
+    }
+    m_Wake.notify_all();
+
+    for (size_t i = 0; i < m_Workers.size(); i++)
+        m_Workers[i].join();
+}
+
+void ThreadPool::Submit(Task task)
+{
+    Queue& queue = *m_Queues[m_NextQueue++ % m_Queues.size()];
+    m_Pending++;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // counted under the wake lock so a worker about to sleep cannot miss it
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_Queued++;
+    }
+    m_Wake.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_WakeMutex);
+    m_Idle.wait(lock, [this] { return m_Pending == 0; });
+}
+
+int ThreadPool::GetThreadCount() const
+{
+    return (int)m_Workers.size();
+}
+
+long long ThreadPool::GetStealCount() const
+{
+    return m_Steals;
+}
+
+int ThreadPool::GetHardwareThreads()
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    return threads > 0 ? (int)threads : 1;
+}
+
+void ThreadPool::WorkerLoop(int self)
+{
+    for (;;)
+    {
+        Task task;
+        if (PopLocal(self, task) || Steal(self, task))
+        {
+            task();
+
+            if (--m_Pending == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_WakeMutex);
+                m_Idle.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_WakeMutex);
+        m_Wake.wait(lock, [this] { return m_Stopping || m_Queued > 0; });
+        if (m_Stopping && m_Queued == 0)
+            return;
+    }
+}
+
+// Newest task from this worker's own deque, its data is most likely still in cache
+bool ThreadPool::PopLocal(int self, Task& task)
+{
+    Queue& queue = *m_Queues[self];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return false;
+
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    m_Queued--;
+    return true;
+}
+
+// Oldest task from the next worker that has one
+bool ThreadPool::Steal(int self, Task& task)
+{
+    int count = (int)m_Queues.size();
+    for (int i = 1; i < count; i++)
+    {
+        Queue& queue = *m_Queues[(self + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        m_Queued--;
+        m_Steals++;
+        return true;
+    }
+    return false;
+}
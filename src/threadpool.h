@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task deque. A worker runs
+// its own tasks newest first and, when it runs dry, steals the oldest task
+// from another worker, so uneven jobs still keep every core busy.
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // queues are filled round robin
+    void Submit(Task task);
+
+    // blocks until every submitted task has finished
+    void Wait();
+
+    int GetThreadCount() const;
+    long long GetStealCount() const;
+
+    static int GetHardwareThreads();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex ;
+        std::deque<Task> tasks ;
+    };
+
+    void WorkerLoop(int self);
+    bool PopLocal(int self, Task& task);
+    bool Steal(int self, Task& task);
+
+    std::vector<std::unique_ptr<Queue> > m_Queues ;
+    std::vector<std::thread> m_Workers ;
+
+    std::mutex m_WakeMutex ;
+    std::condition_variable m_Wake ;  // a task was queued or the pool is stopping
+    std::condition_variable m_Idle ;  // the last pending task finished
+
+    std::atomic<int> m_Queued ;       // tasks sitting in a deque
+    std::atomic<int> m_Pending ;      // tasks queued or running
+    std::atomic<long long> m_Steals ;
+    std::atomic<unsigned> m_NextQueue ;
+    bool m_Stopping ;
+};
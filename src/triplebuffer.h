@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Hands the latest value from one writer thread to one reader thread
+// without locks. The writer fills the back slot and publishes it by
+// swapping it with the shared slot; the reader takes the shared slot in
+// exchange for its front slot when a newer value is there. Neither side
+// ever waits, and the reader skips values it was too slow to see.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : m_Back(0), m_Shared(1), m_Front(2) {}
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // writer side
+    T& GetBack() { return m_Slots[m_Back]; }
+    void Publish()
+    {
+        m_Back = m_Shared.exchange(m_Back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // reader side, true when a value newer than the front one was taken
+    bool Take()
+    {
+        if (0 == (m_Shared.load(std::memory_order_acquire) & FRESH))
+            return false;
+        m_Front = m_Shared.exchange(m_Front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& GetFront() const { return m_Slots[m_Front]; }
+
+private:
+    static const uint8_t INDEX = 3 ;
+    static const uint8_t FRESH = 4 ; // the shared slot has not been taken yet
+
+    T m_Slots[3] ;
+    // each side's index on its own cache line
+    alignas(64) uint8_t m_Back ;
+    alignas(64) std::atomic<uint8_t> m_Shared ;
+    alignas(64) uint8_t m_Front ;
+};